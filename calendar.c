@@ -0,0 +1,89 @@
+//***************************************************************************
+//
+//  File        : calendar.c
+//  Copyright   : 2013 Paul Chote
+//  Description : Converts between calendar dates and seconds or days since 1970-01-01
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#include "calendar.h"
+
+// The conversions treat the year as starting on March 1st, so that the
+// leap day falls at the end of the year, and split the date into 400 year
+// eras of 146097 days.  This gives closed-form expressions with no loops.
+// Dates before 1970 are not supported.
+//
+// Times are held internally as seconds since 1970-01-01 (struct epoch_time)
+// and only converted to calendar form (struct timestamp) at the display
+// and USB edges.
+
+// Days from 0000-03-01 to 1970-01-01
+#define EPOCH_OFFSET 719468UL
+
+#define DAYS_PER_ERA 146097UL
+
+uint32_t calendar_days_from_civil(uint16_t year, uint8_t month, uint8_t day)
+{
+    uint16_t y = year - (month <= 2);
+    uint16_t era = y / 400;
+    uint16_t year_of_era = y - era * 400;
+    uint16_t day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    uint32_t day_of_era = 365UL * year_of_era + year_of_era / 4 - year_of_era / 100 + day_of_year;
+
+    return era * DAYS_PER_ERA + day_of_era - EPOCH_OFFSET;
+}
+
+void calendar_civil_from_days(uint32_t days, uint16_t *year, uint8_t *month, uint8_t *day)
+{
+    uint32_t z = days + EPOCH_OFFSET;
+    uint16_t era = z / DAYS_PER_ERA;
+    uint32_t day_of_era = z - era * DAYS_PER_ERA;
+    uint16_t year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    uint16_t day_of_year = day_of_era - (365UL * year_of_era + year_of_era / 4 - year_of_era / 100);
+    uint8_t m = (5 * day_of_year + 2) / 153;
+
+    *day = day_of_year - (153 * m + 2) / 5 + 1;
+    *month = m < 10 ? m + 3 : m - 9;
+    *year = era * 400 + year_of_era + (*month <= 2);
+}
+
+/*
+ * Move a date from a receiver that doesn't account for the GPS week
+ * rollover into the 1024 week window that starts at pivot
+ */
+uint32_t calendar_unroll_gps_week(uint32_t days, uint32_t pivot)
+{
+    if (days >= pivot)
+        return days;
+
+    uint16_t rollovers = (pivot - days + GPS_ROLLOVER_DAYS - 1) / GPS_ROLLOVER_DAYS;
+    return days + rollovers * GPS_ROLLOVER_DAYS;
+}
+
+void calendar_time_of_day(uint32_t seconds, uint8_t *hours, uint8_t *minutes, uint8_t *secs)
+{
+    uint32_t day_seconds = seconds % SECONDS_PER_DAY;
+    *hours = day_seconds / 3600;
+
+    uint16_t hour_seconds = day_seconds - *hours * 3600UL;
+    *minutes = hour_seconds / 60;
+    *secs = hour_seconds % 60;
+}
+
+/*
+ * Convert a device time to the calendar form used by the display and USB packets
+ * milliseconds is copied unchanged, so may be >= 1000 (see millisecond_count)
+ */
+void calendar_timestamp(struct timestamp *t, const struct epoch_time *e, uint16_t milliseconds)
+{
+    calendar_civil_from_days(e->seconds / SECONDS_PER_DAY, &t->year, &t->month, &t->day);
+    calendar_time_of_day(e->seconds, &t->hours, &t->minutes, &t->seconds);
+    t->milliseconds = milliseconds;
+    t->flags = e->flags;
+    t->utc_offset = e->utc_offset;
+    t->exposure_progress = 0;
+}
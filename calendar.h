@@ -0,0 +1,30 @@
+//***************************************************************************
+//
+//  File        : calendar.h
+//  Copyright   : 2013 Paul Chote
+//  Description : Converts between calendar dates and seconds or days since 1970-01-01
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#ifndef KARAKA_CALENDAR_H
+#define KARAKA_CALENDAR_H
+
+#include <stdint.h>
+#include "main.h"
+
+// 1024 GPS weeks
+#define GPS_ROLLOVER_DAYS 7168UL
+
+#define SECONDS_PER_DAY 86400UL
+
+uint32_t calendar_days_from_civil(uint16_t year, uint8_t month, uint8_t day);
+void calendar_civil_from_days(uint32_t days, uint16_t *year, uint8_t *month, uint8_t *day);
+uint32_t calendar_unroll_gps_week(uint32_t days, uint32_t pivot);
+void calendar_time_of_day(uint32_t seconds, uint8_t *hours, uint8_t *minutes, uint8_t *secs);
+void calendar_timestamp(struct timestamp *t, const struct epoch_time *e, uint16_t milliseconds);
+
+#endif
@@ -11,8 +11,10 @@
 //***************************************************************************
 
 #include <avr/interrupt.h>
+#include <util/atomic.h>
 #include "camera.h"
 #include "main.h"
+#include "settings.h"
 
 enum monitor_mode {MONITOR_IDLE, MONITOR_START, MONITOR_ACQUIRING, MONITOR_STOP};
 volatile enum monitor_mode monitor_mode = MONITOR_IDLE;
@@ -21,6 +23,35 @@ enum camera_status {CAMERA_READY, CAMERA_BUSY};
 volatile enum camera_status camera_status = CAMERA_READY;
 bool monitor_camera_status = true;
 
+volatile struct camera_overrun camera_overrun;
+
+// Set when OVERRUN_DELAY is waiting for the camera to become ready
+static volatile bool trigger_deferred = false;
+
+// Camera logic edges are timestamped by the timer 1 input capture unit
+// and then confirmed by the debounce interrupt
+struct edge_time
+{
+    uint32_t milliseconds;
+    uint16_t ticks;
+};
+
+static struct edge_time trigger_edge;
+static struct edge_time busy_edge;
+static struct edge_time ready_edge;
+static struct edge_time readout_start;
+static bool readout_started = false;
+
+// Accumulated readout durations in microseconds
+static uint16_t readout_count;
+static uint32_t readout_min;
+static uint32_t readout_max;
+static uint64_t readout_sum;
+static uint32_t readout_cycle_max;
+
+// Debounce period, 0.512ms
+#define DEBOUNCE_MICROSECONDS 512
+
 // 6.71 seconds
 #define SIMULATED_STARTUP 0xFFFF
 
@@ -39,16 +70,76 @@ void camera_initialize()
     // Enable pullup resistor on monitor input
     PORTD |= _BV(PD6);
 
+    camera_restore_trigger_timer();
+
+    // Debounce timeout / simulated camera delay
+    TIMSK3 |= _BV(OCIE3A);
+    TCCR3B = _BV(WGM32);
+
+    // Timestamp monitor edges (PD6 / ICP1) against the millisecond timer
+    // The noise canceler rejects glitches shorter than 0.4us
+    TCCR1B |= _BV(ICNC1) | _BV(ICES1);
+    TIFR1 = _BV(ICF1);
+    TIMSK1 |= _BV(ICIE1);
+}
+
+// Configure timer 0 to time trigger pulses
+// Also used to reclaim the timer from the frequency counter
+void camera_restore_trigger_timer()
+{
     // Set trigger length to 512us
     // and disable until it is needed
+    TCCR0B = 0;
     OCR0A = 79;
     TCCR0A = _BV(WGM01);
-    TIMSK0 |= _BV(OCIE0A);
-    TCCR0B = 0;
+    TIMSK0 = _BV(OCIE0A);
+    TIFR0 = _BV(OCF0A) | _BV(OCF0B) | _BV(TOV0);
+}
 
-    // Debounce timeout / simulated camera delay
-    TIMSK3 |= _BV(OCIE3A);
-    TCCR3B = _BV(WGM32);
+static void reset_readout_stats()
+{
+    readout_started = false;
+    readout_count = 0;
+    readout_min = UINT32_MAX;
+    readout_max = 0;
+    readout_sum = 0;
+    readout_cycle_max = 0;
+}
+
+// Microseconds between two edges
+static uint32_t edge_interval(struct edge_time *start, struct edge_time *end)
+{
+    return (end->milliseconds - start->milliseconds) * 1000 +
+        (int16_t)(end->ticks - start->ticks) / 10;
+}
+
+// Must only be called from interrupt context
+static void read_edge_time(struct edge_time *edge, uint16_t ticks)
+{
+    edge->milliseconds = millisecond_uptime;
+    edge->ticks = ticks;
+
+    // The timer has wrapped but the interrupt hasn't been serviced yet
+    if (bit_is_set(TIFR1, OCF1A) && ticks < 5000)
+        edge->milliseconds++;
+}
+
+// Capture the time of a camera logic edge
+// The debounce interrupt uses the most recent edge of each polarity
+ISR(TIMER1_CAPT_vect)
+{
+    uint16_t ticks = ICR1;
+    if (bit_is_set(TCCR1B, ICES1))
+        read_edge_time(&busy_edge, ticks);
+    else
+        read_edge_time(&ready_edge, ticks);
+
+    // Wait for the opposite edge to the current input level
+    if (bit_is_set(PIND, PD6))
+        TCCR1B &= ~_BV(ICES1);
+    else
+        TCCR1B |= _BV(ICES1);
+    TIFR1 = _BV(ICF1);
 }
 
 /*
@@ -92,6 +183,8 @@ void camera_start_exposing(bool monitor_camera)
 {
     monitor_camera_status = monitor_camera;
     monitor_mode = MONITOR_START;
+    trigger_deferred = false;
+    reset_readout_stats();
 
     if (!monitor_camera_status)
         simulate_camera_busy(SIMULATED_STARTUP);
@@ -108,6 +201,8 @@ void camera_start_exposing(bool monitor_camera)
 // exposure-stop command is sent while reading out
 void camera_stop_exposing()
 {
+    trigger_deferred = false;
+
     if (camera_status == CAMERA_READY)
     {
         // Camera is not exposing - can stop immediately
@@ -139,6 +234,43 @@ ISR(TIMER3_COMPA_vect)
         return;
 
     camera_status = status;
+
+    // Measure readouts that start during the exposure sequence
+    if (monitor_camera_status && monitor_mode == MONITOR_ACQUIRING)
+    {
+        if (status == CAMERA_BUSY)
+        {
+            readout_start = busy_edge;
+            readout_started = true;
+        }
+        else if (readout_started)
+        {
+            uint32_t duration = edge_interval(&readout_start, &ready_edge);
+            if (duration < readout_min)
+                readout_min = duration;
+            if (duration > readout_max)
+                readout_max = duration;
+            readout_sum += duration;
+            readout_count++;
+
+            uint32_t cycle = edge_interval(&trigger_edge, &ready_edge);
+            if (cycle > readout_cycle_max)
+                readout_cycle_max = cycle;
+
+            readout_started = false;
+        }
+    }
+
+    // Send the trigger that was held back by OVERRUN_DELAY
+    if (trigger_deferred && status == CAMERA_READY)
+    {
+        trigger_deferred = false;
+        camera_trigger_readout();
+        get_device_time((struct device_time *)&camera_overrun.triggered);
+        deferred_trigger_sent();
+        message_flags |= FLAG_CAMERA_OVERRUN;
+    }
+
     switch (monitor_mode)
     {
         case MONITOR_START:
@@ -168,6 +300,8 @@ void camera_trigger_readout()
 {
     PORTD |= _BV(PD5);
     TCCR0B = _BV(CS01) | _BV(CS00);
+    read_edge_time(&trigger_edge, TCNT1);
+    counters.camera_triggers++;
 
     // Suppress status updates for exposures < 500ms
     if (timing_mode == MODE_HIGHRES && exposure_total < 500)
@@ -181,6 +315,78 @@ void camera_trigger_readout()
     }
 }
 
+// Check whether the camera is able to accept the trigger for frame
+// Must be called from interrupt context before triggering the camera.
+// TRIGGER_DEFERRED means that the trigger will be sent by the debounce
+// interrupt once the camera becomes ready (OVERRUN_DELAY)
+//
+// Only the monitored camera logic is checked: the simulated
+// camera status doesn't reflect the real camera state
+enum trigger_action camera_check_overrun(uint32_t frame)
+{
+    if (!monitor_camera_status || (camera_status == CAMERA_READY && !trigger_deferred))
+        return TRIGGER_NOW;
+
+    counters.camera_overruns++;
+
+    // Drop if an earlier trigger is still being held back
+    if (trigger_deferred)
+        return TRIGGER_DROPPED;
+
+    enum overrun_policy policy = settings_get(SETTING_OVERRUN_POLICY);
+    camera_overrun.frame = frame;
+    camera_overrun.policy = policy;
+    get_device_time((struct device_time *)&camera_overrun.detected);
+
+    switch (policy)
+    {
+        case OVERRUN_DELAY:
+            // Reported once the trigger has been sent
+            trigger_deferred = true;
+            return TRIGGER_DEFERRED;
+        case OVERRUN_ABORT:
+            camera_stop_exposing();
+            break;
+        default:
+            break;
+    }
+
+    camera_overrun.triggered = camera_overrun.detected;
+    message_flags |= FLAG_CAMERA_OVERRUN;
+    return policy == OVERRUN_REPORT ? TRIGGER_NOW : TRIGGER_DROPPED;
+}
+
+void camera_get_readout_stats(struct readout_stats *stats)
+{
+    uint64_t sum;
+    uint32_t cycle;
+    ATOMIC_BLOCK(ATOMIC_FORCEON)
+    {
+        stats->count = readout_count;
+        stats->min = readout_min;
+        stats->max = readout_max;
+        sum = readout_sum;
+        cycle = readout_cycle_max;
+    }
+
+    if (stats->count == 0)
+    {
+        stats->min = stats->mean = stats->min_period = 0;
+        return;
+    }
+
+    stats->mean = sum / stats->count;
+
+    // The camera must be confirmed ready before the next trigger
+    stats->min_period = (cycle + DEBOUNCE_MICROSECONDS + 999) / 1000;
+}
+
+// Whether the camera logic output is monitored or simulated
+bool camera_monitor_enabled()
+{
+    return monitor_camera_status;
+}
+
 // End readout trigger by pulling output high
 ISR(TIMER0_COMPA_vect)
 {
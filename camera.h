@@ -14,12 +14,59 @@
 #define KARAKA_CAMERA_H
 
 #include <stdbool.h>
+#include "main.h"
+
+// Action taken when a trigger is due while the camera is still reading out
+// Values are part of the USB protocol
+enum overrun_policy
+{
+    OVERRUN_REPORT = 0, // Trigger anyway and report the overrun
+    OVERRUN_SKIP = 1,   // Don't trigger, extending the exposure to the next period
+    OVERRUN_DELAY = 2,  // Trigger as soon as the camera becomes ready
+    OVERRUN_ABORT = 3,  // Stop the exposure sequence
+};
+
+// Details of the most recent overrun, reported via FLAG_CAMERA_OVERRUN
+// triggered is the time that the delayed trigger was sent (OVERRUN_DELAY)
+// or equal to detected for the other policies
+struct camera_overrun
+{
+    uint32_t frame;
+    enum overrun_policy policy;
+    struct device_time detected;
+    struct device_time triggered;
+};
+
+extern volatile struct camera_overrun camera_overrun;
+
+enum trigger_action
+{
+    TRIGGER_NOW,
+    TRIGGER_DEFERRED,
+    TRIGGER_DROPPED,
+};
+
+// Camera readout durations over the current exposure sequence, in microseconds
+// min_period is the shortest exposure period (in milliseconds) that leaves the
+// camera ready before the next trigger, based on the slowest trigger-to-ready time
+struct readout_stats
+{
+    uint16_t count;
+    uint32_t min;
+    uint32_t mean;
+    uint32_t max;
+    uint16_t min_period;
+};
 
 void camera_initialize();
+void camera_restore_trigger_timer();
 void camera_tick();
 
 void camera_start_exposing(bool monitor_camera);
 void camera_stop_exposing();
 void camera_trigger_readout();
+enum trigger_action camera_check_overrun(uint32_t frame);
+bool camera_monitor_enabled();
+void camera_get_readout_stats(struct readout_stats *stats);
 
 #endif
\ No newline at end of file
@@ -13,6 +13,8 @@
 #include "main.h"
 #include "display.h"
 #include "gps.h"
+#include "frequency.h"
+#include "calendar.h"
 
 #include <avr/pgmspace.h>
 #include <avr/interrupt.h>
@@ -154,6 +156,8 @@ static const char msg_wait[]        PROGMEM = " WAITING FOR CAMERA ";
 static const char msg_relay[]       PROGMEM = "     RELAY MODE     ";
 static const char msg_expose_c[]    PROGMEM = "       EXPOSE       ";
 static const char msg_readout_c[]   PROGMEM = "       READOUT      ";
+static const char msg_counting[]    PROGMEM = " FREQUENCY COUNTER  ";
+static const char fmt_frequency[]   PROGMEM = "  %9lu.%03u Hz  ";
 
 // For display with countdown
 static const char msg_align[]       PROGMEM = "  ALIGN             ";
@@ -472,7 +476,7 @@ void display_update()
             break;
         case TIMER_ALIGN:
             set_msg_P(DISPLAY_TOP | DISPLAY_LEFT, msg_align);
-            set_fmt_P(DISPLAY_TOP | DISPLAY_RIGHT, fmt_countdown, current_timestamp.seconds % align_boundary, align_boundary);
+            set_fmt_P(DISPLAY_TOP | DISPLAY_RIGHT, fmt_countdown, (uint8_t)(current_time.seconds % align_boundary), align_boundary);
             break;
         case TIMER_EXPOSING:
         case TIMER_READOUT:
@@ -506,6 +510,16 @@ void display_update()
                 }
             }
             break;
+        case TIMER_COUNTING:
+        {
+            uint32_t frequency;
+            if (frequency_last(&frequency))
+                set_fmt_P(DISPLAY_TOP | DISPLAY_LEFT | DISPLAY_RIGHT, fmt_frequency,
+                          frequency / 1000, (uint16_t)(frequency % 1000));
+            else
+                set_msg_P(DISPLAY_TOP | DISPLAY_LEFT | DISPLAY_RIGHT, msg_counting);
+            break;
+        }
         case TIMER_IDLE:
         default:
             set_msg_P(DISPLAY_TOP | DISPLAY_LEFT | DISPLAY_RIGHT, msg_idle);
@@ -516,13 +530,12 @@ void display_update()
     {
         case GPS_ACTIVE:
         {
-            const char *fmt = (current_timestamp.flags & TIMESTAMP_LOCKED) ?
-                (current_timestamp.flags & TIMESTAMP_IS_GPS) ? fmt_time_gps : fmt_time_utc : fmt_time_nolock;
-            set_fmt_P(DISPLAY_BOTTOM | DISPLAY_LEFT | DISPLAY_RIGHT, fmt,
-                current_timestamp.hours,
-                current_timestamp.minutes,
-                current_timestamp.seconds
-            );
+            uint8_t hours, minutes, seconds;
+            calendar_time_of_day(current_time.seconds, &hours, &minutes, &seconds);
+
+            const char *fmt = (current_time.flags & TIMESTAMP_LOCKED) ?
+                (current_time.flags & TIMESTAMP_IS_GPS) ? fmt_time_gps : fmt_time_utc : fmt_time_nolock;
+            set_fmt_P(DISPLAY_BOTTOM | DISPLAY_LEFT | DISPLAY_RIGHT, fmt, hours, minutes, seconds);
             break;
         }
         case GPS_SYNCING:
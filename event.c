@@ -0,0 +1,87 @@
+//***************************************************************************
+//
+//  File        : event.c
+//  Copyright   : 2013 Paul Chote
+//  Description : Timestamps external events on the spare input (PC7)
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include "event.h"
+#include "main.h"
+#include "settings.h"
+
+// Must be a power of two
+#define EVENT_BUFFER_LENGTH 64
+
+// Events are captured from interrupt context and
+// drained by usb_tick as the serial link allows
+static struct event event_buffer[EVENT_BUFFER_LENGTH];
+static uint8_t event_read_index = 0;
+static volatile uint8_t event_write_index = 0;
+static uint16_t event_sequence = 0;
+
+void event_initialize()
+{
+    // Enable pullup resistor on the event input
+    DDRC &= ~_BV(PC7);
+    PORTC |= _BV(PC7);
+
+    // Enable pin change interrupt for the event input
+    PCMSK2 |= _BV(PCINT23);
+    PCICR |= _BV(PCIE2);
+}
+
+/*
+ * Event input interrupt handler
+ * Fired on any level change from the event input (PC7)
+ *
+ * Neither of the input capture pins are available (ICP1 monitors the camera,
+ * ICP3 drives the displays), so the time is read from the millisecond timer on
+ * entry to the interrupt. This adds a few microseconds of fixed latency.
+ */
+ISR(PCINT2_vect)
+{
+    struct device_time time;
+    get_device_time(&time);
+    uint8_t level = bit_is_set(PINC, PC7) ? 1 : 0;
+
+    enum event_edges edges = settings_get(SETTING_EVENT_EDGES);
+    if (!(edges & (level ? EVENT_RISING : EVENT_FALLING)))
+        return;
+
+    uint16_t sequence = event_sequence++;
+
+    // Drop the event if the buffer is full
+    if ((uint8_t)(event_write_index - event_read_index) == EVENT_BUFFER_LENGTH)
+    {
+        counters.event_overflows++;
+        return;
+    }
+
+    struct event *e = &event_buffer[event_write_index % EVENT_BUFFER_LENGTH];
+    e->sequence = sequence;
+    e->level = level;
+    e->time = time;
+    event_write_index++;
+}
+
+/*
+ * Read the oldest buffered event
+ * Returns false if there are no events waiting
+ */
+bool event_read(struct event *e)
+{
+    if (event_read_index == event_write_index)
+        return false;
+
+    *e = event_buffer[event_read_index % EVENT_BUFFER_LENGTH];
+    event_read_index++;
+    return true;
+}
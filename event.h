@@ -0,0 +1,42 @@
+//***************************************************************************
+//
+//  File        : event.h
+//  Copyright   : 2013 Paul Chote
+//  Description : Timestamps external events on the spare input (PC7)
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#ifndef KARAKA_EVENT_H
+#define KARAKA_EVENT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "main.h"
+
+// Edges that generate events
+// Values are part of the USB protocol
+enum event_edges
+{
+    EVENT_DISABLED = 0,
+    EVENT_RISING = 1,
+    EVENT_FALLING = 2,
+    EVENT_BOTH = 3,
+};
+
+// sequence counts every captured edge, including those dropped when the buffer is full
+// level is the input level after the edge
+struct event
+{
+    uint16_t sequence;
+    uint8_t level;
+    struct device_time time;
+};
+
+void event_initialize();
+bool event_read(struct event *e);
+
+#endif
@@ -0,0 +1,174 @@
+//***************************************************************************
+//
+//  File        : frequency.c
+//  Copyright   : 2013 Paul Chote
+//  Description : Measures the frequency of the signal on T0 (PB0) against the GPS
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include "camera.h"
+#include "frequency.h"
+#include "main.h"
+
+// Reciprocal counter:
+//   Timer 0 counts input cycles, extended to 32 bits by the overflow interrupt.
+//   Each GPS pulse arms the compare B interrupt for the next input edge,
+//   which samples the millisecond timer.  The frequency is the number of
+//   cycles between consecutive sampled edges divided by the time between
+//   them, so the resolution is set by the 0.1us timer rather than the gate.
+//   The input must be slower than F_CPU / 2.5 (4MHz).
+
+static volatile uint32_t overflow_count;
+
+// Set while waiting for the first input edge after a pulse
+static volatile bool gate_armed = false;
+static struct device_time gate_time;
+
+// Previous sampled edge
+static bool edge_valid = false;
+static uint32_t edge_cycles;
+static uint32_t edge_ticks;
+
+// Most recent measurement, waiting to be sent
+static struct frequency_reading reading;
+static volatile bool reading_pending = false;
+
+// Most recent frequency, for the display
+static uint32_t last_frequency;
+static bool last_valid = false;
+
+void frequency_start()
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        overflow_count = 0;
+        gate_armed = false;
+        edge_valid = false;
+        reading_pending = false;
+        last_valid = false;
+
+        // Count rising edges on T0 in normal mode
+        // This takes the timer away from the camera trigger
+        TIMSK0 = 0;
+        TCCR0A = 0;
+        TCNT0 = 0;
+        TIFR0 = _BV(TOV0) | _BV(OCF0A) | _BV(OCF0B);
+        TIMSK0 = _BV(TOIE0);
+        TCCR0B = _BV(CS02) | _BV(CS01) | _BV(CS00);
+    }
+}
+
+void frequency_stop()
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        gate_armed = false;
+        camera_restore_trigger_timer();
+    }
+}
+
+/*
+ * Start a new measurement at a GPS pulse
+ * Must only be called from the pulse interrupt after align_millisecond_timer
+ */
+void frequency_gate()
+{
+    // No input edges have been seen since the last pulse
+    if (gate_armed)
+    {
+        reading.time = gate_time;
+        reading.cycles = reading.ticks = 0;
+        reading_pending = true;
+        edge_valid = false;
+    }
+
+    get_device_time(&gate_time);
+
+    // Interrupt on the next input edge
+    OCR0B = TCNT0 + 1;
+    TIFR0 = _BV(OCF0B);
+    TIMSK0 |= _BV(OCIE0B);
+    gate_armed = true;
+}
+
+ISR(TIMER0_OVF_vect)
+{
+    overflow_count++;
+}
+
+/*
+ * Sample the millisecond timer at the first input edge after a pulse
+ */
+ISR(TIMER0_COMPB_vect)
+{
+    uint16_t ticks = TCNT1;
+    uint32_t ms = millisecond_uptime;
+
+    // The timer has wrapped but the interrupt hasn't been serviced yet
+    if (bit_is_set(TIFR1, OCF1A) && ticks < 5000)
+        ms++;
+
+    uint8_t count = OCR0B;
+    uint32_t overflows = overflow_count;
+    if (bit_is_set(TIFR0, TOV0) && count < 128)
+        overflows++;
+
+    TIMSK0 &= ~_BV(OCIE0B);
+    gate_armed = false;
+
+    uint32_t edge = (overflows << 8) | count;
+    uint32_t time = ms * 10000 + ticks;
+    if (edge_valid)
+    {
+        reading.time = gate_time;
+        reading.cycles = edge - edge_cycles;
+        reading.ticks = time - edge_ticks;
+        reading_pending = true;
+    }
+
+    edge_cycles = edge;
+    edge_ticks = time;
+    edge_valid = true;
+}
+
+/*
+ * Read the most recent measurement
+ * Returns false if there isn't a new measurement
+ */
+bool frequency_read(struct frequency_reading *r)
+{
+    if (!reading_pending)
+        return false;
+
+    ATOMIC_BLOCK(ATOMIC_FORCEON)
+    {
+        *r = reading;
+        reading_pending = false;
+    }
+
+    // Convert cycles per 0.1us to mHz
+    r->frequency = 0;
+    if (r->ticks > 0)
+        r->frequency = ((uint64_t)r->cycles * 10000000000ULL + r->ticks / 2) / r->ticks;
+
+    last_frequency = r->frequency;
+    last_valid = true;
+    return true;
+}
+
+/*
+ * Most recent frequency in mHz, for the display
+ * Returns false if no measurement has been made since the counter started
+ */
+bool frequency_last(uint32_t *frequency)
+{
+    *frequency = last_frequency;
+    return last_valid;
+}
@@ -0,0 +1,38 @@
+//***************************************************************************
+//
+//  File        : frequency.h
+//  Copyright   : 2013 Paul Chote
+//  Description : Measures the frequency of the signal on T0 (PB0) against the GPS
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#ifndef KARAKA_FREQUENCY_H
+#define KARAKA_FREQUENCY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "main.h"
+
+// Measurement over the input cycles that started within one GPS second
+// cycles is the number of whole input cycles, ticks is their duration in 0.1us
+// frequency is cycles / ticks in mHz, or zero if no input edges were seen
+// time is the device clock at the pulse that started the measurement
+struct frequency_reading
+{
+    struct device_time time;
+    uint32_t cycles;
+    uint32_t ticks;
+    uint32_t frequency;
+};
+
+void frequency_start();
+void frequency_stop();
+void frequency_gate();
+bool frequency_read(struct frequency_reading *r);
+bool frequency_last(uint32_t *frequency);
+
+#endif
@@ -2,7 +2,7 @@
 //
 //  File        : gps.c
 //  Copyright   : 2013 Paul Chote
-//  Description : Parses time information from a Trimble or Magellan serial stream
+//  Description : Parses time information from a Trimble, Magellan, NMEA or u-blox serial stream
 //
 //  This file is part of Karaka, which is free software. It is made available
 //  to you under the terms of version 3 of the GNU General Public License, as
@@ -14,13 +14,30 @@
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
 #include <util/atomic.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <string.h>
 #include "main.h"
 #include "gps.h"
 #include "usb.h"
+#include "settings.h"
+#include "calendar.h"
 
-enum packet_state {TB_HEADER = 0, TB_TYPEA, TB_TYPEB, TB_DATA, TB_FOOTERA, TB_FOOTERB,
-                   MGL_HEADERA, MGL_HEADERB, MGL_TYPE, MGL_DATA, MGL_CHECKSUM, MGL_FOOTER};
+// Longest NMEA sentence between the '$' and '*'
+#define NMEA_MAX_LENGTH 80
+
+// Longest TSIP frame, including the DLE padding
+#define TSIP_MAX_SIZE 160
+
+// Longest UBX payload
+#define UBX_MAX_LENGTH 128
+
+#define TSIP_DLE 0x10
+#define TSIP_ETX 0x03
+
+// The packet structs describe the field offsets for the frame_* accessors
+// Received data is decoded in place from the input buffer, not copied into them
+#define FIELD(type, field) offsetof(struct type, field)
 
 struct trimble_timestamp
 {
@@ -61,32 +78,112 @@ struct magellan_status
     uint8_t status;
 };
 
-struct gps_packet
+// TSIP 8F-AC: Supplemental timing packet, sent after 8F-AB
+struct trimble_supplemental
+{
+    uint8_t receiver_mode;
+    uint8_t disciplining_mode;
+    uint8_t survey_progress;
+
+    // Big endian
+    uint32_t holdover;
+    uint16_t critical_alarms;
+    uint16_t minor_alarms;
+
+    uint8_t decoding_status;
+    uint8_t disciplining_activity;
+    uint8_t spare[2];
+
+    // Big endian IEEE floats
+    uint32_t pps_offset;
+    uint32_t clock_offset;
+    uint32_t dac_value;
+    uint32_t dac_voltage;
+    uint32_t temperature;
+
+    uint8_t position[24];
+
+    // Big endian IEEE float
+    // Quantization error of the next PPS in ns (Resolution-T only)
+    uint32_t pps_quantization_error;
+    uint8_t spare2[4];
+};
+
+// Replies to the 8E-A5 and 8E-A2 initialization commands
+#define TRIMBLE_REPORT_MASK 0xA5
+#define TRIMBLE_REPORT_TIMING 0xA2
+
+// Minor alarms that indicate the timing can't be trusted:
+// antenna open, antenna shorted, not tracking satellites,
+// position questionable, PPS not generated
+#define TRIMBLE_DEGRADED_MINOR_ALARMS 0x120E
+
+// UBX-TIM-TP: Sent before each time pulse, describing the upcoming pulse
+struct ubx_timepulse
 {
-    enum packet_state state;
+    // Little endian
+    uint32_t tow_ms;
+    uint32_t tow_sub_ms;
+    int32_t quantization_error;
+    uint16_t week;
+    uint8_t flags;
+    uint8_t reference;
+};
+
+#define UBX_CLASS_TIM 0x0D
+#define UBX_ID_TIM_TP 0x01
+#define UBX_TIMEPULSE_QERR_INVALID _BV(4)
+
+// A complete frame in the input buffer
+struct gps_frame
+{
+    enum gps_protocol protocol;
+
+    // TSIP packet ID and subcode, Magellan message type,
+    // NMEA sentence formatter, or UBX class and ID
+    uint8_t id[3];
+
+    // Input buffer index of the first payload byte
+    // The payload may wrap around the end of the buffer
+    uint8_t start;
     uint8_t length;
-    uint8_t progress;
 
-    // Checksum for magellan, padding flag for trimble
-    uint8_t extra;
+    // Bytes used by the frame, including the header and footer
+    uint8_t size;
 
-    union
-    {
-        struct trimble_timestamp trimble;
-        struct magellan_timestamp magellan_time;
-        struct magellan_status magellan_status;
-        uint8_t bytes[1];
-    } data;
+    // Arrival time of the first byte
+    struct uptime received;
+};
+
+enum frame_status
+{
+    FRAME_INCOMPLETE, // More data is needed; size is the minimum frame size
+    FRAME_INVALID,    // Not the start of a frame
+    FRAME_CORRUPT,    // Bad checksum or footer; size bytes are discarded
+    FRAME_COMPLETE
+};
+
+struct gps_handler
+{
+    enum gps_protocol protocol;
+    uint8_t id[3];
+    enum gps_packet_type type;
+
+    // Expected payload length, or 0 for variable length frames
+    uint8_t length;
+    void (*parse)(const struct gps_frame *f);
 };
 
-// Init Magellan: Disable the packets that the OEM software enables; enable timing and status packets
-const char initialization_data[] PROGMEM = ""
-    // Trimble initialization
-    // Disable everything except the 8F-AB timing packet
-    "\x10\x8E\xA5\x00\x01\x00\x00\x10\x03"
+// Trimble initialization
+const char trimble_initialization[] PROGMEM = ""
+    // Disable everything except the 8F-AB and 8F-AC timing packets
+    "\x10\x8E\xA5\x00\x05\x00\x00\x10\x03"
     // Configure UTC time output
-    "\x10\x8E\xA2\x03\x10\x03"
-    // Magellan initialization
+    "\x10\x8E\xA2\x03\x10\x03";
+
+// Magellan initialization
+// Disable the packets that the OEM software enables; enable timing and status packets
+const char magellan_initialization[] PROGMEM = ""
     "$PMGLI,00,G00,0,A\r\n"
     "$PMGLI,00,B00,0,A\r\n"
     "$PMGLI,00,B02,0,A\r\n"
@@ -97,20 +194,190 @@ const char initialization_data[] PROGMEM = ""
     "$PMGLI,00,S01,0,A\r\n"
     "$PMGLI,00,A00,2,B\r\n"
     "$PMGLI,00,H00,2,B\r\n";
-const uint8_t initialization_length = 205;
+
+// u-blox initialization
+const char ubx_initialization[] PROGMEM = ""
+    // Enable UBX-TIM-TP and NMEA ZDA on the current port
+    "\xB5\x62\x06\x01\x03\x00\x0D\x01\x01\x19\x69"
+    "\xB5\x62\x06\x01\x03\x00\xF0\x08\x01\x03\x20";
+
+// The commands contain zero bytes, so are sent by length
+// The length excludes the string terminator
+struct initialization
+{
+    const char *data;
+    uint8_t length;
+};
+
+#define INITIALIZATION(data) {data, sizeof(data) - 1}
+
+// Each receiver ignores the initialization for the others,
+// so all three are sent when the protocol isn't known
+static const struct initialization initialization_data[] = {
+    [GPS_PROTOCOL_TRIMBLE] = INITIALIZATION(trimble_initialization),
+    [GPS_PROTOCOL_MAGELLAN] = INITIALIZATION(magellan_initialization),
+    [GPS_PROTOCOL_UBX] = INITIALIZATION(ubx_initialization)
+};
+
+// Every command must be sent in full to be acknowledged
+// The lengths are the sum of the commands in each string
+_Static_assert(sizeof(trimble_initialization) - 1 == 9 + 6, "Trimble initialization is 8E-A5 and 8E-A2");
+_Static_assert(sizeof(magellan_initialization) - 1 == 10 * 19, "Magellan initialization is 10 PMGLI commands");
+_Static_assert(sizeof(ubx_initialization) - 1 == 2 * 11, "u-blox initialization is 2 CFG-MSG commands");
+
+// Bitmask of initialization_data entries that haven't been queued for sending
+static uint8_t init_pending = 0;
+static uint8_t init_offset = 0;
+
+// Acknowledgements expected from the receiver for the queued initialization
+static uint8_t init_acks_pending = 0;
+static uint8_t init_retries = 0;
+
+// Unacknowledged initialization is resent once per PROBE_WINDOW
+#define INIT_RETRIES 5
+
+#define UBX_CLASS_CFG 0x06
+#define UBX_ID_CFG_PRT 0x00
+#define UBX_ID_CFG_MSG 0x01
+#define UBX_CLASS_ACK 0x05
+#define UBX_ID_ACK_ACK 0x01
+
+// UBX-CFG-PRT: Serial port configuration
+struct ubx_port_config
+{
+    // Little endian
+    uint8_t port;
+    uint8_t reserved;
+    uint16_t tx_ready;
+    uint32_t mode;
+    uint32_t baud;
+    uint16_t in_protocols;
+    uint16_t out_protocols;
+    uint16_t flags;
+    uint16_t reserved2;
+};
+
+// UBX-CFG-PRT is the longest rate change command
+#define MAX_BAUD_COMMAND_LENGTH (8 + sizeof(struct ubx_port_config))
+
+// Baud rate register values assume double speed mode
+#define UBRR_2X(baud) ((F_CPU + 4UL * (baud)) / (8UL * (baud)) - 1)
+
+struct baud_info
+{
+    uint32_t rate;
+    uint16_t ubrr;
+
+    // TSIP 0xBC baud rate index
+    uint8_t tsip;
+};
+
+static const struct baud_info baud_info[] PROGMEM = {
+    {0, 0, 0}, // GPS_BAUD_AUTO
+    {9600, UBRR_2X(9600), 7},
+    {19200, UBRR_2X(19200), 8},
+    {38400, UBRR_2X(38400), 9},
+    {57600, UBRR_2X(57600), 10},
+    {115200, UBRR_2X(115200), 11},
+};
+
+// Each rate is listened to for 2.05 seconds (80 timer 2 counts)
+// to allow for receivers that only send a packet every second
+#define PROBE_WINDOW 80
+
+//   PROBE_LISTEN: Initialization sent at the current rate, waiting for a valid packet
+//   PROBE_UPGRADE: Waiting for space to send the rate change command
+//   PROBE_SWITCH: Waiting for the rate change command to finish sending
+//   PROBE_VERIFY: Receiver told to switch rate, waiting for a valid packet at the new rate
+//   PROBE_CONFIGURE: Initialization sent for the detected protocol, waiting for acknowledgement
+//   PROBE_LOCKED: Protocol and rate are known and the receiver is configured
+enum probe_state {PROBE_LISTEN, PROBE_UPGRADE, PROBE_SWITCH, PROBE_VERIFY, PROBE_CONFIGURE, PROBE_LOCKED};
+static enum probe_state probe_state = PROBE_LISTEN;
+static enum gps_baud probe_baud;
+static enum gps_baud fallback_baud;
+static enum gps_protocol protocol = GPS_PROTOCOL_UNKNOWN;
+
+// Bitmask of the protocols that have sent a valid packet in the current window
+static uint8_t probe_seen = 0;
+
+// Set if the receiver stopped responding after being told to switch rate
+static bool upgrade_failed = false;
+
+static volatile uint8_t probe_ticks = 0;
+static volatile bool transmit_idle = true;
+
+static const char *const protocol_names[] = {"unknown", "Trimble TSIP", "Magellan", "NMEA", "u-blox UBX"};
+static const char detected_fmt[] PROGMEM = "Detected %s GPS at %lu baud";
+static const char unacknowledged_fmt[] PROGMEM = "%s GPS did not acknowledge configuration";
 
 static const char invalid_packet_fmt[]  PROGMEM = "Invalid packet end byte. Got 0x%02x, expected 0x%02x";
 static const char checksum_failed_fmt[] PROGMEM = "Packet checksum failed. Got 0x%02x, expected 0x%02x";
+static const char invalid_length_fmt[]  PROGMEM = "Invalid packet length. Got %u, expected %u";
 
 static uint8_t input_buffer[256];
 static uint8_t input_read = 0;
 static volatile uint8_t input_write = 0;
 
+// Arrival times of bytes that may start a frame, recorded by the receive
+// interrupt so that serial latency doesn't include the main loop delay
+#define ARRIVAL_QUEUE_LENGTH 16
+struct arrival
+{
+    uint8_t index;
+    struct uptime time;
+};
+
+static struct arrival arrival_queue[ARRIVAL_QUEUE_LENGTH];
+static uint8_t arrival_read = 0;
+static volatile uint8_t arrival_write = 0;
+
+// Set after an unpaired DLE, so that a stuffed DLE isn't treated as a frame start
+static bool arrival_dle = false;
+
+// Progress through an incomplete TSIP or NMEA frame at input_read, so that
+// the scan resumes where it stopped when more data arrives
+struct frame_scan
+{
+    // Offset of the next byte to examine, or 0 if the frame hasn't been started
+    uint8_t end;
+
+    // The previous TSIP byte was a DLE that hasn't been paired yet
+    bool dle;
+};
+
+// Reset whenever input_read advances
+static struct frame_scan scan;
+
 static uint8_t output_buffer[256];
 static volatile uint8_t output_read = 0;
 static volatile uint8_t output_write = 0;
 
-static uint8_t serial_timeout_counter = 0;
+static uint16_t serial_timeout_counter = 0;
+
+// Quantization error of the next time pulse, in picoseconds
+// Reported by receivers that support UBX-TIM-TP
+static int32_t next_pulse_error = 0;
+
+static struct gps_health health;
+static bool health_changed = false;
+
+static struct gps_stats stats;
+static enum gps_lock_state lock_state = GPS_LOCK_UNAVAILABLE;
+
+// Timer 2 counts towards the next whole second in stats.lock_seconds
+static uint16_t lock_second_fraction = 0;
+
+static bool magellan_time_locked = false;
+static bool nmea_time_locked = false;
+static bool nmea_has_zda = false;
+
+// RMC sentences received before the first ZDA, saturating at 2
+// RMC is only used for the time once a second has passed without a ZDA,
+// so that both sentences don't label the same pulse
+static uint8_t nmea_rmc_count = 0;
+
+// Forward received bytes to the acquisition PC inside GPS_TUNNEL packets
+static bool tunnel_enabled = false;
 
 /*
  * Add a byte to the send queue and start sending data if necessary
@@ -121,21 +388,16 @@ void gps_send_byte(uint8_t b)
     while (output_write == (uint8_t)(output_read - 1));
 
     output_buffer[output_write++] = b;
+    transmit_idle = false;
 
     // Enable transmit if necessary
     UCSR1B |= _BV(UDRIE1);
 }
 
-static inline bool byte_available()
-{
-    return input_write != input_read;
-}
-
-static uint8_t read_byte()
+// Read a byte relative to the start of the unparsed input
+static inline uint8_t input_peek(uint8_t offset)
 {
-    // Loop until data is available
-    while (input_read == input_write);
-    return input_buffer[input_read++];
+    return input_buffer[(uint8_t)(input_read + offset)];
 }
 
 ISR(USART1_UDRE_vect)
@@ -148,8 +410,28 @@ ISR(USART1_UDRE_vect)
         UCSR1B &= ~_BV(UDRIE1);
 }
 
+// The final byte has left the shift register
+ISR(USART1_TX_vect)
+{
+    transmit_idle = output_write == output_read;
+}
+
 ISR(USART1_RX_vect)
 {
+    // Bytes received at the wrong rate are discarded
+    // so that they don't hold off the serial timeout
+    bool framing_error = bit_is_set(UCSR1A, FE1);
+    uint8_t b = UDR1;
+    if (framing_error)
+        return;
+
+    // Drop new data rather than overwriting data that hasn't been parsed
+    if ((uint8_t)(input_write + 1) == input_read)
+    {
+        stats.overflows++;
+        return;
+    }
+
     // Reset timeout countdown
     serial_timeout_counter = 0;
 
@@ -157,9 +439,320 @@ ISR(USART1_RX_vect)
     if (gps_status == GPS_UNAVAILABLE)
         set_gps_status(GPS_SYNCING);
 
-    input_buffer[(uint8_t)(input_write++)] = UDR1;
+    // Timestamp the first byte of NMEA/Magellan, UBX, and TSIP frames
+    bool frame_start = b == '$' || b == 0xB5 || (b == TSIP_DLE && !arrival_dle);
+    arrival_dle = b == TSIP_DLE && !arrival_dle;
+
+    uint8_t next = (arrival_write + 1) % ARRIVAL_QUEUE_LENGTH;
+    if (frame_start && next != arrival_read)
+    {
+        struct arrival *a = &arrival_queue[arrival_write];
+        a->index = input_write;
+        read_uptime(&a->time);
+        arrival_write = next;
+    }
+
+    input_buffer[(uint8_t)(input_write++)] = b;
+}
+
+/*
+ * Discard arrival times for bytes that have already been parsed
+ * Called before the input buffer can wrap onto a stale index
+ */
+static void discard_arrivals()
+{
+    while (arrival_read != arrival_write)
+    {
+        uint8_t offset = arrival_queue[arrival_read].index - input_read;
+        if (offset < (uint8_t)(input_write - input_read))
+            break;
+
+        arrival_read = (arrival_read + 1) % ARRIVAL_QUEUE_LENGTH;
+    }
+}
+
+/*
+ * Find the arrival time of the byte at input_read
+ * Returns false if it wasn't recorded by the receive interrupt
+ */
+static bool frame_arrival(struct uptime *t)
+{
+    discard_arrivals();
+    if (arrival_read == arrival_write || arrival_queue[arrival_read].index != input_read)
+        return false;
+
+    *t = arrival_queue[arrival_read].time;
+    return true;
+}
+
+static uint8_t output_free()
+{
+    return (uint8_t)(output_read - output_write - 1);
+}
+
+/*
+ * Copy queued initialization strings into the output buffer
+ * without waiting for space to become available
+ */
+static void send_pending_initialization()
+{
+    for (uint8_t i = 0; i < sizeof(initialization_data) / sizeof(initialization_data[0]); i++)
+    {
+        if (!(init_pending & _BV(i)))
+            continue;
+
+        const struct initialization *init = &initialization_data[i];
+        while (init_offset < init->length && output_free() > 0)
+            gps_send_byte(pgm_read_byte(&init->data[init_offset++]));
+
+        if (init_offset < init->length)
+            return;
+
+        init_pending &= ~_BV(i);
+        init_offset = 0;
+    }
+}
+
+/*
+ * Queue the initialization for a protocol, or for all protocols if it isn't known
+ * The receiver acknowledges each Trimble and u-blox configuration command
+ */
+static void queue_initialization(enum gps_protocol p)
+{
+    switch (p)
+    {
+        case GPS_PROTOCOL_UNKNOWN:
+            init_pending = _BV(GPS_PROTOCOL_TRIMBLE) | _BV(GPS_PROTOCOL_MAGELLAN) | _BV(GPS_PROTOCOL_UBX);
+            init_acks_pending = 0;
+            break;
+        case GPS_PROTOCOL_TRIMBLE:
+        case GPS_PROTOCOL_UBX:
+            init_pending = _BV(p);
+            init_acks_pending = 2;
+            break;
+        case GPS_PROTOCOL_MAGELLAN:
+            init_pending = _BV(p);
+            init_acks_pending = 0;
+            break;
+        default:
+            init_pending = 0;
+            init_acks_pending = 0;
+            break;
+    }
+
+    init_offset = 0;
+    probe_ticks = 0;
+    send_pending_initialization();
+}
+
+static void send_ubx(uint8_t class, uint8_t id, const void *payload, uint16_t length)
+{
+    uint8_t header[] = {class, id, length & 0xFF, length >> 8};
+    uint8_t ck_a = 0, ck_b = 0;
+
+    gps_send_byte(0xB5);
+    gps_send_byte(0x62);
+    for (uint8_t i = 0; i < sizeof(header); i++)
+    {
+        ck_a += header[i];
+        ck_b += ck_a;
+        gps_send_byte(header[i]);
+    }
+
+    for (uint16_t i = 0; i < length; i++)
+    {
+        uint8_t b = ((const uint8_t *)payload)[i];
+        ck_a += b;
+        ck_b += ck_a;
+        gps_send_byte(b);
+    }
+
+    gps_send_byte(ck_a);
+    gps_send_byte(ck_b);
+}
+
+/*
+ * Tell the receiver to switch to a new rate
+ * Returns false if the protocol doesn't support changing rate
+ */
+static bool send_baud_command(enum gps_baud baud)
+{
+    switch (protocol)
+    {
+        case GPS_PROTOCOL_TRIMBLE:
+        {
+            // TSIP 0xBC: Current port, 8N1, TSIP in and out
+            uint8_t code = pgm_read_byte(&baud_info[baud].tsip);
+            uint8_t command[] = {0x10, 0xBC, 0xFF, code, code, 0x03, 0x00, 0x00, 0x00, 0x02, 0x02, 0x00, 0x10, 0x03};
+            for (uint8_t i = 0; i < sizeof(command); i++)
+                gps_send_byte(command[i]);
+            return true;
+        }
+        case GPS_PROTOCOL_UBX:
+        {
+            // UART1, 8N1, UBX and NMEA in and out
+            struct ubx_port_config config = {
+                .port = 1,
+                .mode = 0x000008D0,
+                .baud = pgm_read_dword(&baud_info[baud].rate),
+                .in_protocols = 0x03,
+                .out_protocols = 0x03
+            };
+            send_ubx(UBX_CLASS_CFG, UBX_ID_CFG_PRT, &config, sizeof(config));
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+static void set_baud(enum gps_baud baud)
+{
+    uint16_t ubrr = pgm_read_word(&baud_info[baud].ubrr);
+    UBRR1H = ubrr >> 8;
+    UBRR1L = ubrr & 0xFF;
+
+    probe_baud = baud;
+    probe_seen = 0;
+    probe_ticks = 0;
+}
+
+static void start_listen(enum gps_baud baud)
+{
+    set_baud(baud);
+    protocol = GPS_PROTOCOL_UNKNOWN;
+    probe_state = PROBE_LISTEN;
+
+    // Silent receivers start sending once they are configured
+    queue_initialization(GPS_PROTOCOL_UNKNOWN);
+}
+
+// Resend the initialization for the detected protocol at the final rate
+// so that the acknowledgements can be matched up
+static void start_configure()
+{
+    probe_state = PROBE_CONFIGURE;
+    init_retries = 0;
+    queue_initialization(protocol);
 }
 
+static void detected(enum gps_protocol detected)
+{
+    protocol = detected;
+
+    // Relay mode leaves the rate unchanged for the configuration software
+    enum gps_baud target = settings_get(SETTING_GPS_MAX_BAUD);
+    if (upgrade_failed || timer_status == TIMER_RELAY || settings_get(SETTING_GPS_BAUD) != GPS_BAUD_AUTO ||
+        target <= probe_baud || (protocol != GPS_PROTOCOL_TRIMBLE && protocol != GPS_PROTOCOL_UBX))
+        start_configure();
+    else
+        probe_state = PROBE_UPGRADE;
+}
+
+/*
+ * Step through the supported rates until a receiver responds,
+ * switch it to the fastest allowed rate and then configure it
+ *
+ * Each step only queues as much data as fits in the output buffer,
+ * so the main loop is never held up by the receiver
+ */
+static void probe_tick()
+{
+    send_pending_initialization();
+
+    switch (probe_state)
+    {
+        case PROBE_LISTEN:
+        {
+            // A u-blox receiver sends NMEA until the initialization enables UBX
+            // so NMEA is only accepted if nothing else is seen in the window
+            bool expired = probe_ticks >= PROBE_WINDOW;
+            if (probe_seen & _BV(GPS_PROTOCOL_TRIMBLE))
+                detected(GPS_PROTOCOL_TRIMBLE);
+            else if (probe_seen & _BV(GPS_PROTOCOL_UBX))
+                detected(GPS_PROTOCOL_UBX);
+            else if (probe_seen & _BV(GPS_PROTOCOL_MAGELLAN))
+                detected(GPS_PROTOCOL_MAGELLAN);
+            else if (expired && (probe_seen & _BV(GPS_PROTOCOL_NMEA)))
+                detected(GPS_PROTOCOL_NMEA);
+            else if (expired && settings_get(SETTING_GPS_BAUD) == GPS_BAUD_AUTO)
+                start_listen(GPS_BAUD_9600 + probe_baud % GPS_BAUD_115200);
+            else if (expired)
+                start_listen(probe_baud);
+            break;
+        }
+        case PROBE_UPGRADE:
+            // Wait for space rather than blocking in gps_send_byte
+            if (init_pending || output_free() < MAX_BAUD_COMMAND_LENGTH)
+                break;
+
+            send_baud_command(settings_get(SETTING_GPS_MAX_BAUD));
+            probe_state = PROBE_SWITCH;
+            break;
+        case PROBE_SWITCH:
+            // The command must be sent at the old rate
+            if (!transmit_idle)
+                break;
+
+            fallback_baud = probe_baud;
+            set_baud(settings_get(SETTING_GPS_MAX_BAUD));
+            probe_state = PROBE_VERIFY;
+            break;
+        case PROBE_VERIFY:
+            if (probe_seen & _BV(protocol))
+                start_configure();
+            else if (probe_ticks >= PROBE_WINDOW)
+            {
+                upgrade_failed = true;
+                start_listen(fallback_baud);
+            }
+            break;
+        case PROBE_CONFIGURE:
+            if (init_acks_pending == 0)
+            {
+                probe_state = PROBE_LOCKED;
+                usb_send_message_fmt_P(detected_fmt, protocol_names[protocol],
+                                       pgm_read_dword(&baud_info[probe_baud].rate));
+            }
+            else if (probe_ticks >= PROBE_WINDOW)
+            {
+                if (++init_retries < INIT_RETRIES)
+                    queue_initialization(protocol);
+                else
+                {
+                    // Timing packets are still parsed if the receiver was already configured
+                    probe_state = PROBE_LOCKED;
+                    usb_send_message_fmt_P(unacknowledged_fmt, protocol_names[protocol]);
+                }
+            }
+            break;
+        case PROBE_LOCKED:
+            // Receiver has gone away, and may have lost its configuration
+            // or been replaced by a different model
+            if (gps_status == GPS_UNAVAILABLE && timer_status != TIMER_RELAY)
+            {
+                upgrade_failed = false;
+                start_listen(probe_baud);
+            }
+            break;
+    }
+}
+
+static void frame_received(enum gps_protocol p)
+{
+    probe_seen |= _BV(p);
+}
+
+static void init_acknowledged()
+{
+    if (probe_state == PROBE_CONFIGURE && init_acks_pending > 0)
+        init_acks_pending--;
+}
+
+/*
+ * Start configuring the GPS
+ * The configuration is sent from gps_tick, so this returns immediately
+ */
 void gps_initialize()
 {
     // Serial timeout watchdog
@@ -170,277 +763,818 @@ void gps_initialize()
     TIMSK2 |= _BV(OCIE2A);
     OCR2A = 250;
 
-    // Set baud rate to 9600
-    // and timeout counter to 16.384ms
-#define BAUD 9600
-#include <util/setbaud.h>
-    UBRR1H = UBRRH_VALUE;
-    UBRR1L = UBRRL_VALUE;
-#if USE_2X
-    UCSR1A = _BV(U2X0);
-#endif
+    // Enable double speed, receive, transmit, data received and transmit complete interrupts
+    UCSR1A = _BV(U2X1);
+    UCSR1B = _BV(RXEN1)|_BV(TXEN1)|_BV(RXCIE1)|_BV(TXCIE1);
 
-    // Enable receive, transmit, data received interrupt
-    UCSR1B = _BV(RXEN1)|_BV(TXEN1)|_BV(RXCIE1);
+    // Start detection at the highest rate, in case the receiver
+    // is still configured from before the reset
+    enum gps_baud baud = settings_get(SETTING_GPS_BAUD);
+    start_listen(baud == GPS_BAUD_AUTO ? settings_get(SETTING_GPS_MAX_BAUD) : baud);
+}
 
-    // Send GPS configuration data
-    for (uint8_t i = 0; i < initialization_length; i++)
-        gps_send_byte(pgm_read_byte(&initialization_data[i]));
+/*
+ * Count lock acquisitions and losses for the statistics
+ * seconds is the receiver time that the lock was acquired
+ */
+static void set_lock_state(enum gps_lock_state state, uint32_t seconds)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        if (state == GPS_LOCK_LOCKED && lock_state != GPS_LOCK_LOCKED)
+            stats.last_lock = seconds;
+        else if (state != GPS_LOCK_LOCKED && lock_state == GPS_LOCK_LOCKED)
+            stats.lock_losses++;
+
+        lock_state = state;
+    }
 }
 
 ISR(TIMER2_COMPA_vect)
 {
-    // No data received in 3 seconds
-    if (++serial_timeout_counter == 118)
+    if (probe_ticks < UINT8_MAX)
+        probe_ticks++;
+
+    // Each count is 25.6ms, i.e. 16/625 seconds
+    lock_second_fraction += 16;
+    if (lock_second_fraction >= 625)
+    {
+        lock_second_fraction -= 625;
+        stats.lock_seconds[lock_state]++;
+    }
+
+    // No data received within the timeout period
+    // Each count is 25.6ms, i.e. 625/16 counts per second
+    uint16_t timeout = settings_get(SETTING_GPS_TIMEOUT) * 625 / 16;
+    if (++serial_timeout_counter >= timeout)
     {
         set_gps_status(GPS_UNAVAILABLE);
+        set_lock_state(GPS_LOCK_UNAVAILABLE, 0);
         serial_timeout_counter = 0;
     }
 }
 
-// Swap the endian-ness of a 16-bit integer
-static inline uint16_t swap_bytes(uint16_t b)
+// Read payload fields in place from the input buffer
+static inline uint8_t frame_byte(const struct gps_frame *f, uint8_t offset)
+{
+    return input_buffer[(uint8_t)(f->start + offset)];
+}
+
+static uint16_t frame_be16(const struct gps_frame *f, uint8_t offset)
+{
+    return (uint16_t)frame_byte(f, offset) << 8 | frame_byte(f, offset + 1);
+}
+
+static uint32_t frame_be32(const struct gps_frame *f, uint8_t offset)
 {
-    return ((b & 0xFF00) >> 8) | ((b & 0xFF) << 8);
+    return (uint32_t)frame_be16(f, offset) << 16 | frame_be16(f, offset + 2);
 }
 
-static uint8_t is_leap_year(uint16_t year)
+static uint32_t frame_le32(const struct gps_frame *f, uint8_t offset)
 {
-    if (year % 4) return 0;
-    if (year % 100) return 1;
-    return (year % 400) ? 0 : 1;
+    uint32_t value = 0;
+    for (uint8_t i = 4; i > 0; i--)
+        value = value << 8 | frame_byte(f, offset + i - 1);
+    return value;
 }
 
-void parse_packet(struct gps_packet *p)
+// Convert a big-endian IEEE float to a native float
+static float frame_be_float(const struct gps_frame *f, uint8_t offset)
 {
-    static bool magellan_time_locked = false;
-    switch (p->length)
+    union
     {
-        case sizeof(struct trimble_timestamp):
+        uint32_t i;
+        float f;
+    } u;
+    u.i = frame_be32(f, offset);
+    return u.f;
+}
+
+static void set_pulse_error(int32_t error)
+{
+    ATOMIC_BLOCK(ATOMIC_FORCEON)
+    {
+        next_pulse_error = error;
+    }
+}
+
+/*
+ * Set the time from a receiver date, correcting for receivers that
+ * haven't been updated for the GPS week rollover
+ */
+static void set_receiver_time(const struct gps_frame *f, struct timestamp *t)
+{
+    if (t->month < 1 || t->month > 12 || t->day < 1 || t->day > 31)
+        return;
+
+    if (t->hours > 23 || t->minutes > 59 || t->seconds > 59)
+        return;
+
+    uint32_t days = calendar_days_from_civil(t->year, t->month, t->day);
+    days = calendar_unroll_gps_week(days, settings_get(SETTING_GPS_ROLLOVER_PIVOT));
+
+    struct epoch_time e = {
+        .seconds = days * SECONDS_PER_DAY + t->hours * 3600UL + t->minutes * 60 + t->seconds,
+        .flags = t->flags,
+        .utc_offset = t->utc_offset
+    };
+
+    set_lock_state(t->flags & TIMESTAMP_LOCKED ? GPS_LOCK_LOCKED : GPS_LOCK_UNLOCKED, e.seconds);
+    set_time(&e, &f->received);
+}
+
+/*
+ * TSIP 8F-AB: Primary timing packet
+ */
+static void parse_trimble_timestamp(const struct gps_frame *f)
+{
+    struct timestamp t = (struct timestamp) {
+        .year = frame_be16(f, FIELD(trimble_timestamp, year)),
+        .month = frame_byte(f, FIELD(trimble_timestamp, month)),
+        .day = frame_byte(f, FIELD(trimble_timestamp, day)),
+        .hours = frame_byte(f, FIELD(trimble_timestamp, hours)),
+        .minutes = frame_byte(f, FIELD(trimble_timestamp, minutes)),
+        .seconds = frame_byte(f, FIELD(trimble_timestamp, seconds)),
+        .milliseconds = 0,
+        .flags = 0,
+        .utc_offset = 0,
+        .exposure_progress = 0,
+    };
+
+    uint8_t flags = frame_byte(f, FIELD(trimble_timestamp, flags));
+
+    // UTC Time, Locked
+    if (flags == 0x03)
+        t.flags = TIMESTAMP_LOCKED;
+
+    // GPS Time, Locked
+    else if (flags == 0x00)
+    {
+        t.flags = TIMESTAMP_LOCKED | TIMESTAMP_IS_GPS;
+        t.utc_offset = frame_be16(f, FIELD(trimble_timestamp, utc_offset));
+    }
+
+    // Health from the previous 8F-AC packet
+    if (health.degraded)
+        t.flags |= TIMESTAMP_DEGRADED;
+
+    set_receiver_time(f, &t);
+}
+
+/*
+ * TSIP 8F-AC: Supplemental timing packet
+ */
+static void parse_trimble_supplemental(const struct gps_frame *f)
+{
+    struct gps_health h = {
+        .valid = true,
+        .receiver_mode = frame_byte(f, FIELD(trimble_supplemental, receiver_mode)),
+        .disciplining_mode = frame_byte(f, FIELD(trimble_supplemental, disciplining_mode)),
+        .critical_alarms = frame_be16(f, FIELD(trimble_supplemental, critical_alarms)),
+        .minor_alarms = frame_be16(f, FIELD(trimble_supplemental, minor_alarms)),
+        .decoding_status = frame_byte(f, FIELD(trimble_supplemental, decoding_status)),
+        .pulse_error = frame_be_float(f, FIELD(trimble_supplemental, pps_quantization_error)) * 1000
+    };
+
+    h.degraded = h.critical_alarms != 0 || h.decoding_status != 0 ||
+        (h.minor_alarms & TRIMBLE_DEGRADED_MINOR_ALARMS);
+
+    // Telemetry is only sent on changes, so ignore the pulse error
+    health_changed |= memcmp(&h, &health, offsetof(struct gps_health, pulse_error)) != 0;
+    health = h;
+
+    set_pulse_error(h.pulse_error);
+}
+
+/*
+ * TSIP 8F-A5 and 8F-A2: Replies to the initialization commands
+ */
+static void parse_trimble_reply(__attribute__((unused)) const struct gps_frame *f)
+{
+    init_acknowledged();
+}
+
+static void parse_magellan_status(const struct gps_frame *f)
+{
+    magellan_time_locked = frame_byte(f, FIELD(magellan_status, status)) == 0x06;
+}
+
+static void parse_magellan_timestamp(const struct gps_frame *f)
+{
+    set_receiver_time(f, &(struct timestamp){
+        .year = frame_be16(f, FIELD(magellan_timestamp, year)),
+        .month = frame_byte(f, FIELD(magellan_timestamp, month)),
+        .day = frame_byte(f, FIELD(magellan_timestamp, day)),
+        .hours = frame_byte(f, FIELD(magellan_timestamp, hours)),
+        .minutes = frame_byte(f, FIELD(magellan_timestamp, minutes)),
+        .seconds = frame_byte(f, FIELD(magellan_timestamp, seconds)),
+        .milliseconds = 0,
+        .flags = magellan_time_locked ? TIMESTAMP_LOCKED : 0,
+        .utc_offset = 0,
+        .exposure_progress = 0
+    });
+}
+
+// Read a fixed number of decimal digits from an NMEA sentence
+static bool parse_decimal(const struct gps_frame *f, uint8_t offset, uint8_t digits, uint16_t *value)
+{
+    if (offset + digits > f->length)
+        return false;
+
+    uint16_t v = 0;
+    for (uint8_t i = 0; i < digits; i++)
+    {
+        uint8_t b = frame_byte(f, offset + i);
+        if (b < '0' || b > '9')
+            return false;
+        v = 10 * v + (b - '0');
+    }
+
+    *value = v;
+    return true;
+}
+
+// Find the offset of a comma-separated field in an NMEA sentence
+// Field 0 is the talker and sentence identifier
+static uint8_t nmea_field(const struct gps_frame *f, uint8_t field)
+{
+    uint8_t i = 0;
+    while (field > 0 && i < f->length)
+        if (frame_byte(f, i++) == ',')
+            field--;
+
+    return i;
+}
+
+static uint8_t parse_hex(uint8_t b)
+{
+    if (b >= '0' && b <= '9')
+        return b - '0';
+    if (b >= 'A' && b <= 'F')
+        return b - 'A' + 10;
+    return 0xFF;
+}
+
+// Set the time from the hhmmss field of an NMEA ZDA or RMC sentence
+static void set_nmea_time(const struct gps_frame *f, uint16_t day, uint16_t month, uint16_t year)
+{
+    uint16_t hours, minutes, seconds;
+    uint8_t time = nmea_field(f, 1);
+    if (!parse_decimal(f, time, 2, &hours) ||
+        !parse_decimal(f, time + 2, 2, &minutes) ||
+        !parse_decimal(f, time + 4, 2, &seconds))
+        return;
+
+    set_receiver_time(f, &(struct timestamp){
+        .year = year,
+        .month = month,
+        .day = day,
+        .hours = hours,
+        .minutes = minutes,
+        .seconds = seconds,
+        .milliseconds = 0,
+        .flags = nmea_time_locked ? TIMESTAMP_LOCKED : 0,
+        .utc_offset = 0,
+        .exposure_progress = 0
+    });
+}
+
+/*
+ * NMEA ZDA: Time and date
+ * Preferred over RMC because it includes the full year
+ */
+static void parse_nmea_zda(const struct gps_frame *f)
+{
+    nmea_has_zda = true;
+
+    uint16_t day, month, year;
+    if (!parse_decimal(f, nmea_field(f, 2), 2, &day) ||
+        !parse_decimal(f, nmea_field(f, 3), 2, &month) ||
+        !parse_decimal(f, nmea_field(f, 4), 4, &year))
+        return;
+
+    set_nmea_time(f, day, month, year);
+}
+
+/*
+ * NMEA RMC: Recommended minimum data
+ * Provides the lock status, and is used for the time if ZDA isn't available
+ * The first sentence is skipped in case a ZDA follows it in the same second
+ */
+static void parse_nmea_rmc(const struct gps_frame *f)
+{
+    nmea_time_locked = frame_byte(f, nmea_field(f, 2)) == 'A';
+    if (nmea_has_zda)
+        return;
+
+    if (nmea_rmc_count < 2)
+        nmea_rmc_count++;
+
+    if (nmea_rmc_count < 2)
+        return;
+
+    uint16_t day, month, year;
+    uint8_t date = nmea_field(f, 9);
+    if (!parse_decimal(f, date, 2, &day) ||
+        !parse_decimal(f, date + 2, 2, &month) ||
+        !parse_decimal(f, date + 4, 2, &year))
+        return;
+
+    set_nmea_time(f, day, month, year + 2000);
+}
+
+/*
+ * UBX-TIM-TP: Store the quantization error for the next time pulse
+ */
+static void parse_ubx_timepulse(const struct gps_frame *f)
+{
+    int32_t error = frame_le32(f, FIELD(ubx_timepulse, quantization_error));
+    if (frame_byte(f, FIELD(ubx_timepulse, flags)) & UBX_TIMEPULSE_QERR_INVALID)
+        error = 0;
+
+    set_pulse_error(error);
+}
+
+/*
+ * UBX-ACK-ACK: Only the CFG-MSG initialization commands are acknowledged while configuring
+ */
+static void parse_ubx_ack(const struct gps_frame *f)
+{
+    if (frame_byte(f, 0) == UBX_CLASS_CFG && frame_byte(f, 1) == UBX_ID_CFG_MSG)
+        init_acknowledged();
+}
+
+// Frames that are parsed; all others are skipped
+// New packet types are supported by adding a parser and an entry here
+static const struct gps_handler handlers[] PROGMEM = {
+    {GPS_PROTOCOL_TRIMBLE, {0x8F, 0xAB}, GPS_PACKET_TSIP_TIMING,
+        sizeof(struct trimble_timestamp), parse_trimble_timestamp},
+    {GPS_PROTOCOL_TRIMBLE, {0x8F, 0xAC}, GPS_PACKET_TSIP_SUPPLEMENTAL,
+        sizeof(struct trimble_supplemental), parse_trimble_supplemental},
+    {GPS_PROTOCOL_TRIMBLE, {0x8F, TRIMBLE_REPORT_MASK}, GPS_PACKET_TSIP_REPLY, 4, parse_trimble_reply},
+    {GPS_PROTOCOL_TRIMBLE, {0x8F, TRIMBLE_REPORT_TIMING}, GPS_PACKET_TSIP_REPLY, 1, parse_trimble_reply},
+    {GPS_PROTOCOL_MAGELLAN, {'A'}, GPS_PACKET_MAGELLAN_TIME,
+        sizeof(struct magellan_timestamp), parse_magellan_timestamp},
+    {GPS_PROTOCOL_MAGELLAN, {'H'}, GPS_PACKET_MAGELLAN_STATUS,
+        sizeof(struct magellan_status), parse_magellan_status},
+    {GPS_PROTOCOL_NMEA, {'Z', 'D', 'A'}, GPS_PACKET_NMEA_ZDA, 0, parse_nmea_zda},
+    {GPS_PROTOCOL_NMEA, {'R', 'M', 'C'}, GPS_PACKET_NMEA_RMC, 0, parse_nmea_rmc},
+    {GPS_PROTOCOL_UBX, {UBX_CLASS_TIM, UBX_ID_TIM_TP}, GPS_PACKET_UBX_TIMEPULSE,
+        sizeof(struct ubx_timepulse), parse_ubx_timepulse},
+    {GPS_PROTOCOL_UBX, {UBX_CLASS_ACK, UBX_ID_ACK_ACK}, GPS_PACKET_UBX_ACK, 2, parse_ubx_ack},
+};
+
+/*
+ * Find the handler whose id starts with the first length bytes of id
+ * h may be NULL to check whether a handler exists
+ */
+static bool find_handler(enum gps_protocol protocol, const uint8_t *id, uint8_t length, struct gps_handler *h)
+{
+    struct gps_handler entry;
+    for (uint8_t i = 0; i < sizeof(handlers) / sizeof(handlers[0]); i++)
+    {
+        memcpy_P(&entry, &handlers[i], sizeof(entry));
+        if (entry.protocol == protocol && !memcmp(entry.id, id, length))
         {
-            struct trimble_timestamp *tt = &p->data.trimble;
+            if (h)
+                *h = entry;
+            return true;
+        }
+    }
 
-            // Swap from big-endian to little-endian
-            tt->year = swap_bytes(tt->year);
+    return false;
+}
 
-            uint8_t days[12] = {
-                31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31
-            };
+// Send the raw bytes of a frame that failed its footer check
+static void send_raw_frame(uint8_t size)
+{
+    uint8_t raw[TSIP_MAX_SIZE];
+    if (size > sizeof(raw))
+        size = sizeof(raw);
 
-            // The Magellan firmware has not been updated to the new GPS epoch
-            // so we must add 1024 weeks to correct the date
-            uint16_t day = 7168;
+    for (uint8_t i = 0; i < size; i++)
+        raw[i] = input_peek(i);
+    usb_send_raw(raw, size);
+}
 
-            // Rewind to Jan 1 of the assumed year
-            days[1] = is_leap_year(tt->year) ? 29 : 28;
-            for (uint8_t i = 0; i < tt->month - 1; i++)
-                day += days[i];
-            day += tt->day;
-            tt->month = 1;
+/*
+ * TSIP: DLE <id> <data> DLE ETX, with DLE bytes in the data doubled
+ * The padding is removed in place once the whole frame has arrived
+ */
+static enum frame_status find_tsip_frame(uint8_t available, struct gps_frame *f)
+{
+    f->size = 2;
+    if (available < f->size)
+        return FRAME_INCOMPLETE;
 
-            // Advance full years
-            while (day >= 366)
-            {
-                day -= is_leap_year(tt->year) ? 366 : 365;
-                tt->year++;
-            }
+    f->id[0] = input_peek(1);
+    if (scan.end == 0)
+    {
+        if (!find_handler(GPS_PROTOCOL_TRIMBLE, f->id, 1, NULL))
+            return FRAME_INVALID;
 
-            // Advance final partial year
-            days[1] = is_leap_year(tt->year) ? 29 : 28;
-            while (day > days[tt->month - 1])
-                day -= days[tt->month++ - 1];
-
-            struct timestamp t = (struct timestamp) {
-                .year = tt->year,
-                .month = tt->month,
-                .day = day,
-                .hours = tt->hours,
-                .minutes = tt->minutes,
-                .seconds = tt->seconds,
-                .milliseconds = 0,
-                .flags = 0,
-                .utc_offset = 0,
-                .exposure_progress = 0,
-            };
+        scan.end = 2;
+    }
 
-            // UTC Time, Locked
-            if (tt->flags == 0x03)
-                t.flags = TIMESTAMP_LOCKED;
+    // Find the unpadded DLE ETX
+    uint8_t end = scan.end;
+    for (;; end++)
+    {
+        if (end > TSIP_MAX_SIZE)
+            return FRAME_INVALID;
 
-            // GPS Time, Locked
-            else if (tt->flags == 0x00)
-            {
-                t.flags = TIMESTAMP_LOCKED | TIMESTAMP_IS_GPS;
-                t.utc_offset = swap_bytes(tt->utc_offset);
-            }
+        if (end >= available)
+        {
+            scan.end = end;
+            f->size = end + (scan.dle ? 1 : 2);
+            return FRAME_INCOMPLETE;
+        }
 
-            set_time(&t);
-            break;
+        uint8_t b = input_peek(end);
+        if (!scan.dle)
+        {
+            scan.dle = b == TSIP_DLE;
+            continue;
         }
-        case sizeof(struct magellan_status):
+
+        scan.dle = false;
+        if (b == TSIP_ETX)
         {
-            magellan_time_locked = p->data.magellan_status.status == 0x06;
+            // Leave end at the DLE
+            end--;
             break;
         }
-        case sizeof(struct magellan_timestamp):
+
+        // A lone DLE starts the next frame, so leave it to be parsed
+        if (b != TSIP_DLE)
         {
-            struct magellan_timestamp *mt = &p->data.magellan_time;
+            stats.footer_errors++;
+            usb_send_message_fmt_P(invalid_packet_fmt, b, TSIP_ETX);
+            send_raw_frame(end - 1);
+            f->size = end - 1;
+            return FRAME_CORRUPT;
+        }
+    }
 
-            // Swap from big-endian to little-endian
-            mt->year = swap_bytes(mt->year);
+    // Remove the padding from the id and data
+    uint8_t length = 0;
+    for (uint8_t i = 1; i < end; i++)
+    {
+        uint8_t b = input_peek(i);
+        input_buffer[(uint8_t)(input_read + 1 + length++)] = b;
+        if (b == TSIP_DLE)
+            i++;
+    }
 
-            uint8_t days[12] = {
-                31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31
-            };
+    // The 8E and 8F super-packets are identified by a subcode
+    uint8_t header = 2;
+    if ((f->id[0] == 0x8E || f->id[0] == 0x8F) && length > 1)
+        f->id[1] = input_peek(header++);
+
+    f->start = input_read + header;
+    f->length = length + 1 - header;
+    f->size = end + 2;
+    return FRAME_COMPLETE;
+}
+
+/*
+ * Magellan: $$ <type> <data> <checksum> \n
+ * The data length is fixed by the type
+ */
+static enum frame_status find_magellan_frame(uint8_t available, struct gps_frame *f)
+{
+    f->size = 3;
+    if (available < f->size)
+        return FRAME_INCOMPLETE;
 
-            // The Magellan firmware has not been updated to the new GPS epoch
-            // so we must add 1024 weeks to correct the date
-            uint16_t day = 7168;
+    struct gps_handler h;
+    f->id[0] = input_peek(2);
+    if (!find_handler(GPS_PROTOCOL_MAGELLAN, f->id, 1, &h))
+        return FRAME_INVALID;
 
-            // Rewind to Jan 1 of the assumed year
-            days[1] = is_leap_year(mt->year) ? 29 : 28;
-            for (uint8_t i = 0; i < mt->month - 1; i++)
-                day += days[i];
-            day += mt->day;
-            mt->month = 1;
+    f->start = input_read + 3;
+    f->length = h.length;
+    f->size = h.length + 5;
+    if (available < f->size)
+        return FRAME_INCOMPLETE;
 
-            // Advance full years
-            while (day >= 366)
-            {
-                day -= is_leap_year(mt->year) ? 366 : 365;
-                mt->year++;
-            }
+    uint8_t checksum = f->id[0];
+    for (uint8_t i = 0; i < f->length; i++)
+        checksum ^= frame_byte(f, i);
 
-            // Advance final partial year
-            days[1] = is_leap_year(mt->year) ? 29 : 28;
-            while (day > days[mt->month - 1])
-                day -= days[mt->month++ - 1];
-
-            set_time(&(struct timestamp){
-                .year = mt->year,
-                .month = mt->month,
-                .day = day,
-                .hours = mt->hours,
-                .minutes = mt->minutes,
-                .seconds = mt->seconds,
-                .milliseconds = 0,
-                .flags = magellan_time_locked ? TIMESTAMP_LOCKED : 0,
-                .utc_offset = 0,
-                .exposure_progress = 0
-            });
-            break;
-        }
+    uint8_t b = frame_byte(f, f->length);
+    if (b != checksum)
+    {
+        stats.checksum_errors++;
+        usb_send_message_fmt_P(checksum_failed_fmt, b, checksum);
+        return FRAME_CORRUPT;
     }
+
+    b = frame_byte(f, f->length + 1);
+    if (b != '\n')
+    {
+        stats.footer_errors++;
+        usb_send_message_fmt_P(invalid_packet_fmt, b, '\n');
+        return FRAME_CORRUPT;
+    }
+
+    return FRAME_COMPLETE;
 }
 
-void gps_tick()
+/*
+ * NMEA: $<sentence>*<checksum>
+ * The footer is ignored
+ */
+static enum frame_status find_nmea_frame(uint8_t available, struct gps_frame *f)
 {
-    static struct gps_packet p = {.state = TB_HEADER};
-    while (byte_available())
+    // Find the checksum delimiter
+    uint8_t end = scan.end > 1 ? scan.end : 1;
+    for (;; end++)
     {
-        uint8_t b = read_byte();
-        if (timer_status == TIMER_RELAY)
-            usb_send_byte(b);
-
-        switch (p.state)
+        if (end >= available)
         {
-        case TB_HEADER:
-        case MGL_HEADERA:
-            if (b == 0x10)
-                p.state = TB_TYPEA;
-            else if (b == '$')
-                p.state = MGL_HEADERB;
-            break;
+            scan.end = end;
+            f->size = end + 1;
+            return FRAME_INCOMPLETE;
+        }
 
-        // Trimble packets
-        case TB_TYPEA:
-            // We only care about 8F-AB
-            if (b == 0x8F)
-                p.state++;
-            else
-                p.state = TB_HEADER;
-            break;
-        case TB_TYPEB:
-            if (b == 0xAB)
-            {
-                p.length = sizeof(struct trimble_timestamp);
-                p.progress = 0;
-                p.extra = 0;
-                p.state++;
-            }
-            else
-                p.state = TB_HEADER;
+        uint8_t b = input_peek(end);
+        if (b == '*')
             break;
-        case TB_DATA:
-            // Padding byte - The next byte is another 0x10, or 0x03 (frame-end)
-            if (b == 0x10 && (p.extra ^= 1))
-                break;
 
-            p.data.bytes[p.progress++] = b;
-            if (p.progress == p.length)
-                p.state++;
-            break;
-        case TB_FOOTERA:
-            if (b == 0x10)
-                p.state++;
-            else
-            {
-                usb_send_message_fmt_P(invalid_packet_fmt, b, 0x10);
-                usb_send_raw(p.data.bytes, p.length);
-                p.state = TB_HEADER;
-            }
-            break;
-        case TB_FOOTERB:
-            if (b == 0x03)
-                parse_packet(&p);
-            else
+        if (b == '$' || b == '\r' || end > NMEA_MAX_LENGTH)
+            return FRAME_INVALID;
+    }
+
+    f->start = input_read + 1;
+    f->length = end - 1;
+    f->size = end + 3;
+    if (available < f->size)
+    {
+        scan.end = end;
+        return FRAME_INCOMPLETE;
+    }
+
+    uint8_t checksum = 0;
+    for (uint8_t i = 0; i < f->length; i++)
+        checksum ^= frame_byte(f, i);
+
+    uint8_t b = parse_hex(input_peek(end + 1)) << 4 | parse_hex(input_peek(end + 2));
+    if (b != checksum)
+    {
+        stats.checksum_errors++;
+        usb_send_message_fmt_P(checksum_failed_fmt, b, checksum);
+        return FRAME_CORRUPT;
+    }
+
+    // Sentence formatter following the two character talker ID
+    if (f->length > 5)
+        for (uint8_t i = 0; i < sizeof(f->id); i++)
+            f->id[i] = frame_byte(f, i + 2);
+
+    return FRAME_COMPLETE;
+}
+
+/*
+ * UBX: B5 62 <class> <id> <length> <data> <CK_A> <CK_B>
+ */
+static enum frame_status find_ubx_frame(uint8_t available, struct gps_frame *f)
+{
+    f->size = 6;
+    if (available < f->size)
+        return FRAME_INCOMPLETE;
+
+    if (input_peek(1) != 0x62)
+        return FRAME_INVALID;
+
+    f->id[0] = input_peek(2);
+    f->id[1] = input_peek(3);
+    if (!find_handler(GPS_PROTOCOL_UBX, f->id, 2, NULL))
+        return FRAME_INVALID;
+
+    if (input_peek(4) > UBX_MAX_LENGTH || input_peek(5) != 0)
+        return FRAME_INVALID;
+
+    f->start = input_read + 6;
+    f->length = input_peek(4);
+    f->size = f->length + 8;
+    if (available < f->size)
+        return FRAME_INCOMPLETE;
+
+    // Fletcher checksum over the class, id, length and data
+    uint8_t a = 0, b = 0;
+    for (uint8_t i = 2; i < f->length + 6; i++)
+    {
+        a += input_peek(i);
+        b += a;
+    }
+
+    uint8_t ck_a = frame_byte(f, f->length);
+    uint8_t ck_b = frame_byte(f, f->length + 1);
+    if (ck_a != a || ck_b != b)
+    {
+        stats.checksum_errors++;
+        if (ck_a != a)
+            usb_send_message_fmt_P(checksum_failed_fmt, ck_a, a);
+        else
+            usb_send_message_fmt_P(checksum_failed_fmt, ck_b, b);
+        return FRAME_CORRUPT;
+    }
+
+    return FRAME_COMPLETE;
+}
+
+/*
+ * Check for a frame at the start of the unparsed input
+ */
+static enum frame_status find_frame(uint8_t available, struct gps_frame *f)
+{
+    switch (input_peek(0))
+    {
+        case TSIP_DLE:
+            f->protocol = GPS_PROTOCOL_TRIMBLE;
+            return find_tsip_frame(available, f);
+        case 0xB5:
+            f->protocol = GPS_PROTOCOL_UBX;
+            return find_ubx_frame(available, f);
+        case '$':
+            f->size = 2;
+            if (available < f->size)
+                return FRAME_INCOMPLETE;
+
+            if (input_peek(1) == '$')
             {
-                usb_send_message_fmt_P(invalid_packet_fmt, b, 0x03);
-                usb_send_raw(p.data.bytes, p.length);
+                f->protocol = GPS_PROTOCOL_MAGELLAN;
+                return find_magellan_frame(available, f);
             }
-            p.state = TB_HEADER;
-            break;
 
-        // Magellan packets
-        case MGL_HEADERB:
-            if (b == '$')
-                p.state++;
-            else
-                p.state = MGL_HEADERA;
-            break;
-        case MGL_TYPE:
-            if (b == 'A' || b == 'H')
+            if (input_peek(1) >= 'A' && input_peek(1) <= 'Z')
             {
-                p.length = b == 'A' ? sizeof(struct magellan_timestamp) : sizeof(struct magellan_status);
-                p.progress = 0;
-                p.extra = b;
-                p.state++;
+                f->protocol = GPS_PROTOCOL_NMEA;
+                return find_nmea_frame(available, f);
             }
-            else
-                p.state = TB_HEADER;
-            break;
-        case MGL_DATA:
-            p.extra ^= b;
-            p.data.bytes[p.progress++] = b;
-            if (p.progress == p.length)
-                p.state++;
-            break;
-        case MGL_CHECKSUM:
-            if (p.extra == b)
-                p.state++;
-            else
+
+            return FRAME_INVALID;
+        default:
+            return FRAME_INVALID;
+    }
+}
+
+static void parse_frame(const struct gps_frame *f)
+{
+    frame_received(f->protocol);
+
+    struct gps_handler h;
+    if (!find_handler(f->protocol, f->id, sizeof(f->id), &h))
+        return;
+
+    if (h.length != 0 && h.length != f->length)
+    {
+        stats.length_errors++;
+        usb_send_message_fmt_P(invalid_length_fmt, f->length, h.length);
+        return;
+    }
+
+    stats.packets[h.type]++;
+    h.parse(f);
+}
+
+/*
+ * Take the quantization error for the time pulse that has just arrived
+ * Returns zero if the receiver hasn't reported an error for this pulse
+ * Must only be called from the pulse interrupt
+ */
+int32_t gps_pulse_error()
+{
+    int32_t error = next_pulse_error;
+    next_pulse_error = 0;
+    return error;
+}
+
+void gps_get_health(struct gps_health *h)
+{
+    *h = health;
+}
+
+/*
+ * Returns true if the receiver health has changed since the last call
+ */
+bool gps_health_changed()
+{
+    bool changed = health_changed;
+    health_changed = false;
+    return changed;
+}
+
+/*
+ * Copy the receiver statistics, and optionally clear the counters
+ * Clearing in the same step as reading means that no counts are lost
+ */
+void gps_get_stats(struct gps_stats *s, bool reset)
+{
+    ATOMIC_BLOCK(ATOMIC_FORCEON)
+    {
+        *s = stats;
+        if (reset)
+        {
+            memset(&stats, 0, sizeof(stats));
+            stats.last_lock = s->last_lock;
+        }
+    }
+
+    s->protocol = protocol;
+    s->baud = probe_baud;
+}
+
+void gps_enable_tunnel(bool enabled)
+{
+    tunnel_enabled = enabled;
+}
+
+/*
+ * Pass received bytes to the acquisition PC in relay or tunnel mode
+ * This must happen before parsing, which removes TSIP padding in place
+ */
+static void forward_input(uint8_t write)
+{
+    static uint8_t input_forwarded = 0;
+    uint8_t tunnel_buffer[64];
+    uint8_t tunnel_length = 0;
+
+    if (timer_status != TIMER_RELAY && !tunnel_enabled)
+    {
+        input_forwarded = write;
+        return;
+    }
+
+    for (; input_forwarded != write; input_forwarded++)
+    {
+        uint8_t b = input_buffer[input_forwarded];
+        if (timer_status == TIMER_RELAY)
+            usb_send_byte(b);
+
+        if (tunnel_enabled)
+        {
+            tunnel_buffer[tunnel_length++] = b;
+            if (tunnel_length == sizeof(tunnel_buffer))
             {
-                usb_send_message_fmt_P(checksum_failed_fmt, b, p.extra);
-                p.state = MGL_HEADERA;
+                usb_send_gps_tunnel(tunnel_buffer, tunnel_length);
+                tunnel_length = 0;
             }
+        }
+    }
+
+    if (tunnel_length > 0)
+        usb_send_gps_tunnel(tunnel_buffer, tunnel_length);
+}
+
+/*
+ * Parse the complete frames in the input buffer
+ * An incomplete frame is left in place until enough data has arrived
+ * to finish it, and its scan resumes from the first unexamined byte
+ */
+void gps_tick()
+{
+    // Minimum input needed to finish the frame at input_read
+    static uint8_t input_needed = 0;
+
+    uint8_t write = input_write;
+    forward_input(write);
+
+    for (;;)
+    {
+        uint8_t available = write - input_read;
+        if (available == 0 || available < input_needed)
             break;
-        case MGL_FOOTER:
-            if (b == '\n')
-                parse_packet(&p);
-            else
-                usb_send_message_fmt_P(invalid_packet_fmt, b, '\n');
-            p.state = MGL_HEADERA;
+
+        struct gps_frame f = {.id = {0}};
+        enum frame_status status = find_frame(available, &f);
+        if (status == FRAME_INCOMPLETE)
+        {
+            input_needed = f.size;
             break;
         }
+
+        input_needed = 0;
+        scan = (struct frame_scan){0};
+        if (status == FRAME_INVALID)
+        {
+            input_read++;
+            continue;
+        }
+
+        if (status == FRAME_COMPLETE)
+        {
+            // Fall back to the parse time if the queue was full
+            if (!frame_arrival(&f.received))
+                ATOMIC_BLOCK(ATOMIC_FORCEON)
+                    read_uptime(&f.received);
+
+            parse_frame(&f);
+        }
+        input_read += f.size;
     }
+
+    discard_arrivals();
+    probe_tick();
 }
@@ -2,7 +2,7 @@
 //
 //  File        : gps.h
 //  Copyright   : 2013 Paul Chote
-//  Description : Parses time information from a Trimble or Magellan serial stream
+//  Description : Parses time information from a Trimble, Magellan, NMEA or u-blox serial stream
 //
 //  This file is part of Karaka, which is free software. It is made available
 //  to you under the terms of version 3 of the GNU General Public License, as
@@ -16,8 +16,99 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+// Serial rates for the GPS port
+// Values are part of the USB protocol (SETTING_GPS_BAUD, SETTING_GPS_MAX_BAUD)
+enum gps_baud
+{
+    GPS_BAUD_AUTO = 0,
+    GPS_BAUD_9600 = 1,
+    GPS_BAUD_19200 = 2,
+    GPS_BAUD_38400 = 3,
+    GPS_BAUD_57600 = 4,
+    GPS_BAUD_115200 = 5,
+};
+
+enum gps_protocol
+{
+    GPS_PROTOCOL_UNKNOWN = 0,
+    GPS_PROTOCOL_TRIMBLE = 1,
+    GPS_PROTOCOL_MAGELLAN = 2,
+    GPS_PROTOCOL_NMEA = 3,
+    GPS_PROTOCOL_UBX = 4,
+};
+
+// Receiver health reported by the Trimble 8F-AC supplemental timing packet
+// Values are copied from the receiver without interpretation, except
+// pulse_error which is converted to picoseconds
+struct gps_health
+{
+    uint8_t valid;
+    uint8_t degraded;
+    uint8_t receiver_mode;
+    uint8_t disciplining_mode;
+    uint16_t critical_alarms;
+    uint16_t minor_alarms;
+    uint8_t decoding_status;
+    int32_t pulse_error;
+};
+
+// Packet types counted in struct gps_stats
+// Values are part of the USB protocol - append new types only
+enum gps_packet_type
+{
+    GPS_PACKET_TSIP_TIMING = 0,
+    GPS_PACKET_TSIP_SUPPLEMENTAL = 1,
+    GPS_PACKET_TSIP_REPLY = 2,
+    GPS_PACKET_MAGELLAN_TIME = 3,
+    GPS_PACKET_MAGELLAN_STATUS = 4,
+    GPS_PACKET_NMEA_ZDA = 5,
+    GPS_PACKET_NMEA_RMC = 6,
+    GPS_PACKET_UBX_TIMEPULSE = 7,
+    GPS_PACKET_UBX_ACK = 8,
+    GPS_PACKET_TYPE_COUNT
+};
+
+// Values are part of the USB protocol
+enum gps_lock_state
+{
+    GPS_LOCK_UNAVAILABLE = 0, // No time received since the receiver was last seen
+    GPS_LOCK_UNLOCKED = 1,
+    GPS_LOCK_LOCKED = 2,
+    GPS_LOCK_STATE_COUNT
+};
+
+// Receiver link statistics since power on or the last reset
+struct gps_stats
+{
+    enum gps_protocol protocol;
+    enum gps_baud baud;
+
+    // Packets passed to a parser, indexed by enum gps_packet_type
+    uint16_t packets[GPS_PACKET_TYPE_COUNT];
+    uint16_t checksum_errors;
+    uint16_t footer_errors;
+    uint16_t length_errors;
+
+    // Bytes dropped because the receive buffer was full
+    uint16_t overflows;
+
+    uint16_t lock_losses;
+
+    // Seconds spent in each gps_lock_state
+    uint32_t lock_seconds[GPS_LOCK_STATE_COUNT];
+
+    // Receiver time (seconds since 1970) of the most recent lock acquisition, or 0
+    // Kept when the statistics are reset
+    uint32_t last_lock;
+};
+
 void gps_send_byte(uint8_t b);
 void gps_initialize();
 void gps_tick();
+void gps_enable_tunnel(bool enabled);
+int32_t gps_pulse_error();
+void gps_get_health(struct gps_health *h);
+bool gps_health_changed();
+void gps_get_stats(struct gps_stats *s, bool reset);
 
 #endif
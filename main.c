@@ -20,10 +20,15 @@
 #include "display.h"
 #include "usb.h"
 #include "camera.h"
+#include "settings.h"
+#include "event.h"
+#include "frequency.h"
 
 const char msg_duplicate_pulse[] PROGMEM = "WARNING: Missed serial data or duplicate time pulse";
 const char msg_missing_pulse[]   PROGMEM = "WARNING: Missed time pulse";
 const char fmt_time_drift[]      PROGMEM = "WARNING: %dms time drift";
+const char fmt_late_serial[]     PROGMEM = "WARNING: Ignored serial time %ldms after time pulse";
+const char fmt_time_mismatch[]   PROGMEM = "WARNING: Serial time differs from local clock by %lds";
 
 // Internal timing mode
 //    MODE_PULSECOUNTER counts the 1Hz input signal and
@@ -31,6 +36,8 @@ const char fmt_time_drift[]      PROGMEM = "WARNING: %dms time drift";
 //    MODE_HIGHRES uses the 1Hz signal for initial alignment
 //       and stability checks, but all timing is tracked
 //       from the hardware timers (assumes stable CPU clock)
+//    MODE_FREQUENCY doesn't trigger the camera, and instead measures
+//       the frequency of the T0 input over each 1Hz interval
 uint8_t timing_mode = MODE_PULSECOUNTER;
 
 uint16_t exposure_total = 0;
@@ -40,6 +47,7 @@ uint8_t align_boundary = 0;
 volatile uint16_t exposure_countdown = 0;
 volatile uint8_t trigger_countdown = 0;
 volatile enum message_flags message_flags = 0;
+volatile struct counters counters;
 volatile enum timer_status timer_status = TIMER_IDLE;
 volatile enum gps_status gps_status = GPS_UNAVAILABLE;
 
@@ -58,14 +66,168 @@ inline void set_gps_status(enum gps_status status)
     message_flags |= FLAG_SEND_STATUS;
 }
 
-// Internal millisecond count
-// Remains zero if timing_mode == MODE_PULSECOUNTER
+// Internal millisecond count since the time pulse that started current_time
+// The timer runs continuously and is kept phase-locked to the GPS pulse.
+// Each pulse moves the whole seconds into current_time, so values >= 1000
+// indicate that the time pulse is missing
 volatile uint16_t millisecond_count = 0;
+
+// Free-running millisecond count since power on, for measuring intervals
+volatile uint32_t millisecond_uptime = 0;
 volatile int16_t millisecond_drift = 0;
-volatile struct timestamp download_timestamp;
+volatile struct epoch_time download_time;
+volatile uint16_t download_milliseconds = 0;
 volatile bool record_trigger = false;
 
-struct timestamp current_timestamp;
+// Exposure period and stride to apply at the next trigger
+volatile bool period_pending = false;
+uint16_t pending_exposure;
+uint8_t pending_stride;
+
+// Camera triggers and milliseconds since the start of the exposure sequence
+volatile uint32_t frame_count = 0;
+volatile uint32_t sequence_ticks = 0;
+
+// Frame index and tick count of the most recent camera trigger
+volatile uint32_t trigger_frame = 0;
+volatile uint32_t trigger_ticks = 0;
+
+// Frame index and tick count matching download_time
+volatile uint32_t download_frame = 0;
+volatile uint32_t download_ticks = 0;
+
+// Quantization error (ps) of the time pulse that the millisecond timer was last aligned to
+// Add to the trigger time to correct for the receiver's pulse placement
+int32_t alignment_pulse_error = 0;
+int32_t trigger_pulse_error = 0;
+volatile int32_t download_pulse_error = 0;
+
+// Sub-millisecond part of the trigger phase offset
+// Added to download_milliseconds
+volatile uint16_t download_microseconds = 0;
+uint16_t phase_microseconds = 0;
+
+// Whole milliseconds of the phase offset still to wait before the first exposure
+// Counted separately so that it can't overflow exposure_countdown
+uint16_t phase_countdown = 0;
+
+struct epoch_time current_time;
+
+// current_time is advanced by the time pulse and cross-checked against the serial time.
+// It is stepped to the serial time when first set, or when they have disagreed for
+// CLOCK_RESYNC_MISMATCHES consecutive seconds (e.g. after a leap second)
+#define CLOCK_RESYNC_MISMATCHES 3
+static bool clock_valid = false;
+static uint8_t time_mismatches = 0;
+
+// Set by the time pulse until its serial time has been handled
+static volatile bool serial_pending = false;
+
+// Uptime of the most recent GPS pulse, for measuring the serial latency
+static uint32_t pulse_microseconds = 0;
+
+// Delay between the GPS pulse and the serial time that labels it
+static struct gps_latency gps_latency = {.min = UINT32_MAX};
+static uint64_t gps_latency_sum = 0;
+
+// Progress of a trigger that OVERRUN_DELAY held back until the camera became ready
+// Its report waits until the trigger has been sent, so that it carries the actual time
+enum deferred_trigger
+{
+    DEFERRED_NONE,    // The most recent trigger was sent on time
+    DEFERRED_WAITING, // Waiting for the camera
+    DEFERRED_REPORT,  // Waiting for the camera, with the report due
+    DEFERRED_SENT     // Sent at camera_overrun.triggered
+};
+
+static volatile enum deferred_trigger deferred_trigger = DEFERRED_NONE;
+
+/*
+ * Report the most recent trigger with the given time
+ * A deferred trigger is reported with the time that it was actually sent
+ * Must only be called from interrupt context
+ */
+static void report_trigger(const struct epoch_time *time, uint16_t milliseconds, uint16_t microseconds)
+{
+    switch (deferred_trigger)
+    {
+        case DEFERRED_WAITING:
+            deferred_trigger = DEFERRED_REPORT;
+            return;
+        case DEFERRED_REPORT:
+            return;
+        case DEFERRED_SENT:
+            download_time = camera_overrun.triggered.time;
+            download_milliseconds = camera_overrun.triggered.milliseconds;
+            download_microseconds = camera_overrun.triggered.ticks / 10;
+            deferred_trigger = DEFERRED_NONE;
+            break;
+        case DEFERRED_NONE:
+            download_time = *time;
+            download_milliseconds = milliseconds;
+            download_microseconds = microseconds;
+            break;
+    }
+
+    download_frame = trigger_frame;
+    download_ticks = trigger_ticks;
+    download_pulse_error = trigger_pulse_error;
+    message_flags |= FLAG_SEND_TRIGGER;
+}
+
+/*
+ * Called by the camera when a trigger held back by OVERRUN_DELAY has been sent
+ * Must only be called from interrupt context
+ */
+void deferred_trigger_sent()
+{
+    trigger_ticks = sequence_ticks;
+
+    bool report = deferred_trigger == DEFERRED_REPORT;
+    deferred_trigger = DEFERRED_SENT;
+    if (report)
+        report_trigger(NULL, 0, 0);
+}
+
+/*
+ * Report the trigger recorded at the most recent pulse in MODE_PULSECOUNTER,
+ * labelled with current_time, or discard it if the time is unknown
+ */
+static void label_recorded_trigger(bool labelled)
+{
+    if (timing_mode != MODE_PULSECOUNTER || !record_trigger)
+        return;
+
+    record_trigger = false;
+    if (--trigger_countdown != 0)
+        return;
+
+    trigger_countdown = trigger_stride;
+    if (!labelled)
+        return;
+
+    report_trigger(&current_time, 0, 0);
+}
+
+/*
+ * Label the most recent time pulse from the local clock if its serial time
+ * hasn't arrived within SETTING_GPS_PAIRING_WINDOW
+ */
+static void check_serial_timeout()
+{
+    uint32_t window = settings_get(SETTING_GPS_PAIRING_WINDOW);
+    ATOMIC_BLOCK(ATOMIC_FORCEON)
+    {
+        if (!serial_pending || millisecond_count <= window)
+            return;
+
+        serial_pending = false;
+        label_recorded_trigger(clock_valid);
+    }
+
+    if (clock_valid)
+        message_flags |= FLAG_SEND_TIMESTAMP;
+}
 
 int main(void)
 {
@@ -78,13 +240,15 @@ int main(void)
 
     // Set millisecond-timer period to 1ms
     OCR1A = 9999;
-    STOP_MILLISECOND_TIMER;
+    START_MILLISECOND_TIMER;
     TIMSK1 |= _BV(OCIE1A);
 
     // Set other init
+    settings_initialize();
     usb_initialize();
     camera_initialize();
     display_initialize();
+    event_initialize();
 
 	// Enable relay mode until reboot
 	if (eeprom_read_byte(RELAY_EEPROM_OFFSET) == RELAY_ENABLED)
@@ -130,8 +294,12 @@ int main(void)
 
             if (temp_int_flags & FLAG_TIME_DRIFT)
                 usb_send_message_fmt_P(fmt_time_drift, millisecond_drift);
+
+            if (temp_int_flags & FLAG_CAMERA_OVERRUN)
+                usb_send_overrun();
         }
 
+        check_serial_timeout();
         camera_tick();
         usb_tick();
         gps_tick();
@@ -139,31 +307,218 @@ int main(void)
     }
 }
 
+/*
+ * Trigger the camera and record the frame index and time within the sequence
+ * Returns false if the trigger was dropped because the camera is still reading out.
+ * A deferred trigger is reported once deferred_trigger_sent is called
+ * Must only be called from interrupt context
+ */
+static inline bool trigger_camera()
+{
+    switch (camera_check_overrun(frame_count))
+    {
+        case TRIGGER_NOW:
+            camera_trigger_readout();
+            deferred_trigger = DEFERRED_NONE;
+            break;
+        case TRIGGER_DEFERRED:
+            deferred_trigger = DEFERRED_WAITING;
+            break;
+        case TRIGGER_DROPPED:
+            return false;
+    }
+
+    trigger_frame = frame_count++;
+    trigger_ticks = sequence_ticks;
+    trigger_pulse_error = alignment_pulse_error;
+    return true;
+}
+
+/*
+ * Restart the exposure countdown after a trigger, applying a pending period change
+ * The new stride takes effect when the current trigger countdown expires
+ * Must only be called from interrupt context
+ */
+static inline void reload_exposure_countdown()
+{
+    if (period_pending)
+    {
+        exposure_total = pending_exposure;
+        trigger_stride = pending_stride;
+        period_pending = false;
+        display_update_config();
+    }
+
+    exposure_countdown = exposure_total;
+}
+
+/*
+ * Change the period of a running exposure sequence at the next trigger
+ * The exposure is in the units of the current timing mode
+ */
+void set_exposure_period(uint16_t exposure, uint8_t stride)
+{
+    ATOMIC_BLOCK(ATOMIC_FORCEON)
+    {
+        pending_exposure = exposure;
+        pending_stride = stride;
+        period_pending = true;
+    }
+}
+
+/*
+ * Report the trigger from the pulse that has just arrived if it will be downloaded
+ * The serial time for the new second hasn't arrived, so the timestamp is predicted
+ * from the local clock.  set_time sends the confirmed time when it arrives.
+ * Must be called from the pulse interrupt after current_time has been advanced
+ */
+static inline void predict_trigger()
+{
+    // A deferred trigger is only reported once it has been sent
+    if (trigger_countdown != 1 || deferred_trigger != DEFERRED_NONE)
+        return;
+
+    struct epoch_time predicted = current_time;
+    predicted.flags |= TIMESTAMP_PREDICTED;
+    report_trigger(&predicted, millisecond_count, 0);
+}
+
+/*
+ * Trigger the end of a high-resolution exposure and save the time
+ * Must only be called from interrupt context
+ */
+static inline void highres_trigger()
+{
+    bool triggered = trigger_camera();
+    reload_exposure_countdown();
+
+    if (triggered && --trigger_countdown == 0)
+    {
+        report_trigger(&current_time, millisecond_count, phase_microseconds);
+        trigger_countdown = trigger_stride;
+    }
+}
+
 /*
  * Millisecond timer interrupt handler
- * Fired every 1ms when timing_mode == MODE_HIGHRES
+ * Fired every 1ms; counts exposures when timing_mode == MODE_HIGHRES
  */
 ISR(TIMER1_COMPA_vect)
 {
     millisecond_count++;
+    millisecond_uptime++;
+
+    if (timer_status != TIMER_EXPOSING && timer_status != TIMER_READOUT)
+        return;
+
+    sequence_ticks++;
+    if (timing_mode != MODE_HIGHRES)
+        return;
+
+    if (phase_countdown != 0)
+    {
+        phase_countdown--;
+        return;
+    }
 
     // End of exposure - send a trigger and save the time
     // This is a 16-bit operation, but we are in an interrupt so it is atomic
     if (--exposure_countdown == 0)
     {
-        camera_trigger_readout();
-        exposure_countdown = exposure_total;
-
-        if (--trigger_countdown == 0)
+        // Delay the trigger until the sub-millisecond phase offset
+        // unless the compare point has already passed
+        if (phase_microseconds != 0 && TCNT1 < OCR1B)
         {
-            download_timestamp = current_timestamp;
-            download_timestamp.milliseconds = millisecond_count;
-            trigger_countdown = trigger_stride;
-            message_flags |= FLAG_SEND_TRIGGER;
+            TIFR1 = _BV(OCF1B);
+            TIMSK1 |= _BV(OCIE1B);
         }
+        else
+            highres_trigger();
+    }
+}
+
+/*
+ * Phase offset timer interrupt handler
+ * Fired within the millisecond following the end of a high-resolution exposure
+ */
+ISR(TIMER1_COMPB_vect)
+{
+    TIMSK1 &= ~_BV(OCIE1B);
+
+    // The sequence may have been stopped since the interrupt was scheduled
+    if (timer_status == TIMER_EXPOSING || timer_status == TIMER_READOUT)
+        highres_trigger();
+}
+
+/*
+ * Snap the millisecond timer to the GPS pulse that has just arrived
+ * Must only be called from the pulse interrupt outside of a high-resolution sequence
+ */
+static inline void align_millisecond_timer()
+{
+    // See the MODE_HIGHRES alignment below for the origin of this value
+    TCNT1 = 355;
+    alignment_pulse_error = gps_pulse_error();
+
+    // Count a compare match that occurred before the timer was reset
+    uint16_t ms = millisecond_count;
+    if (bit_is_set(TIFR1, OCF1A))
+    {
+        TIFR1 = _BV(OCF1A);
+        millisecond_uptime++;
+        ms++;
+    }
+
+    // Round to the nearest whole second, and apply the same correction to
+    // the sequence tick count.  millisecond_uptime is left free-running so
+    // that intervals measured across the pulse aren't affected
+    uint16_t rounded = ms + 500;
+    rounded -= rounded % 1000;
+    int16_t correction = rounded - millisecond_count;
+    sequence_ticks += correction;
+    millisecond_count = rounded;
+}
+
+/*
+ * Snapshot the GPS-disciplined device clock
+ */
+void get_device_time(struct device_time *t)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        uint16_t ticks = TCNT1;
+        t->time = current_time;
+        t->milliseconds = millisecond_count;
+
+        // The timer has wrapped but the interrupt hasn't been serviced yet
+        if (bit_is_set(TIFR1, OCF1A) && ticks < 5000)
+            t->milliseconds++;
+        t->ticks = ticks;
     }
 }
 
+/*
+ * Capture the free-running uptime
+ * Must be called with interrupts disabled
+ */
+void read_uptime(struct uptime *t)
+{
+    t->ticks = TCNT1;
+    t->milliseconds = millisecond_uptime;
+
+    // The timer has wrapped but the interrupt hasn't been serviced yet
+    if (bit_is_set(TIFR1, OCF1A) && t->ticks < 5000)
+        t->milliseconds++;
+}
+
+/*
+ * Microseconds since power on, wrapping every 71 minutes
+ */
+static uint32_t uptime_microseconds(const struct uptime *t)
+{
+    return t->milliseconds * 1000 + t->ticks / 10;
+}
+
 /*
  * GPS time pulse interrupt handler
  * Fired on any level change from the pulse input (PD4)
@@ -181,12 +536,18 @@ ISR(PCINT3_vect)
     if (bit_is_clear(PIND, PD4))
         return;
 
+    // Set if a pulse-counter trigger was sent at this pulse
+    bool predict = false;
+
     switch (timer_status)
     {
         case TIMER_EXPOSING:
         case TIMER_READOUT:
             if (timing_mode == MODE_HIGHRES)
             {
+                // The timer isn't realigned, so the error of this pulse doesn't apply
+                gps_pulse_error();
+
                 // Test for time drift
                 // Doesn't need to be atomic, as interrupts are disabled in an interrupt context
                 uint16_t drift = millisecond_count;
@@ -197,6 +558,7 @@ ISR(PCINT3_vect)
                 {
                     millisecond_drift = drift > 500 ? (drift - 1000) : drift;
                     message_flags |= FLAG_TIME_DRIFT;
+                    counters.time_drifts++;
                 }
             }
             else
@@ -206,19 +568,33 @@ ISR(PCINT3_vect)
                 // This is a 16-bit operation, but we are in an interrupt so it is atomic
                 if (--exposure_countdown == 0)
                 {
-                    camera_trigger_readout();
-                    exposure_countdown = exposure_total;
-                    record_trigger = true;
+                    record_trigger = trigger_camera();
+                    reload_exposure_countdown();
+                    align_millisecond_timer();
+                    if (record_trigger)
+                    {
+                        // The trigger was referenced to this pulse
+                        trigger_pulse_error = alignment_pulse_error;
+                        predict = true;
+                    }
                 }
+                else
+                    align_millisecond_timer();
             }
             break;
         case TIMER_ALIGN:
             // Start the first exposure so that a (potentially future) exposure
             // boundary will occur on the minute
-            if (current_timestamp.seconds % align_boundary != align_boundary - 1)
+            if (current_time.seconds % align_boundary != (uint8_t)(align_boundary - 1))
+            {
+                align_millisecond_timer();
                 break;
+            }
 
             set_timer_status(TIMER_EXPOSING);
+            frame_count = 0;
+            sequence_ticks = 0;
+            period_pending = false;
             if (timing_mode == MODE_HIGHRES)
             {
                 // Enable the millisecond timer to begin sending triggers
@@ -230,63 +606,187 @@ ISR(PCINT3_vect)
                 // MILLISECOND_TCNT is calibrated with an oscilloscope
                 // to minimize the offset between 1Hz signal and triggers
                 TCNT1 = 355;
-                START_MILLISECOND_TIMER;
+                TIFR1 = _BV(OCF1A);
+                current_time.seconds += (millisecond_count + 500) / 1000;
+                millisecond_count = 0;
+                alignment_pulse_error = gps_pulse_error();
+
+                // Apply the phase offset to the first exposure
+                // The whole milliseconds delay the countdown, and the
+                // remainder is timed by the output compare B interrupt
+                uint32_t phase = settings_get(SETTING_PHASE_OFFSET);
+                phase_countdown = phase / 1000;
+                exposure_countdown = exposure_total;
+                phase_microseconds = phase % 1000;
+                OCR1B = phase_microseconds * 10;
             }
             else
             {
-                camera_trigger_readout();
+                trigger_camera();
+                phase_microseconds = 0;
                 exposure_countdown = exposure_total;
                 record_trigger = true;
+                align_millisecond_timer();
+
+                // The sequence starts at this pulse, so discard the alignment correction
+                sequence_ticks = 0;
+                trigger_pulse_error = alignment_pulse_error;
+                predict = true;
             }
             break;
         case TIMER_RELAY:
             camera_trigger_readout();
+            align_millisecond_timer();
+            break;
+        case TIMER_COUNTING:
+            align_millisecond_timer();
+            frequency_gate();
             break;
         case TIMER_WAITING:
         case TIMER_IDLE:
-            // Do nothing
+            align_millisecond_timer();
             break;
     }
 
+    // Advance the local clock to the label of this pulse, so that it keeps
+    // running through missing or corrupt serial packets.  The count is a whole
+    // number of seconds after alignment, but may be a few milliseconds either
+    // side in MODE_HIGHRES
+    uint16_t elapsed = (millisecond_count + 500) / 1000;
+    uint16_t whole = elapsed * 1000;
+    current_time.seconds += elapsed;
+    millisecond_count = millisecond_count > whole ? millisecond_count - whole : 0;
+    serial_pending = true;
+
+    // The trigger is labelled with the advanced time
+    if (predict)
+        predict_trigger();
+
+    // Sampled after the switch so that the conversion doesn't delay
+    // the trigger or the timer alignment, which are calibrated against
+    // the interrupt latency.  The realigned timer is within a few
+    // microseconds of the pulse
+    struct uptime pulse;
+    read_uptime(&pulse);
+    pulse_microseconds = uptime_microseconds(&pulse);
+
     // Send a warning about the duplicate pulse
     if (gps_last_data == GPS_PULSE)
+    {
         message_flags |= FLAG_DUPLICATE_PULSE;
+        counters.duplicate_pulses++;
+    }
     gps_last_data = GPS_PULSE;
 }
 
-void set_time(struct timestamp *t)
+/*
+ * Record the delay between the GPS pulse and the arrival of the serial time that labels it
+ * Returns false if the serial time arrived outside SETTING_GPS_PAIRING_WINDOW,
+ * in which case it probably describes a different second.  A packet that
+ * arrived before the pulse but was parsed after it is also rejected
+ */
+static bool check_serial_latency(const struct uptime *received)
 {
+    uint32_t latency = uptime_microseconds(received);
     ATOMIC_BLOCK(ATOMIC_FORCEON)
     {
-        current_timestamp = *t;
+        latency -= pulse_microseconds;
     }
-    message_flags |= FLAG_SEND_TIMESTAMP;
 
-    if (gps_status != GPS_ACTIVE)
-        set_gps_status(GPS_ACTIVE);
+    if (latency > settings_get(SETTING_GPS_PAIRING_WINDOW) * 1000)
+    {
+        counters.gps_pairing_rejects++;
+        usb_send_message_fmt_P(fmt_late_serial, (int32_t)latency / 1000);
+        return false;
+    }
+
+    gps_latency.count++;
+    gps_latency.last = latency;
+    if (latency < gps_latency.min)
+        gps_latency.min = latency;
+    if (latency > gps_latency.max)
+        gps_latency.max = latency;
+    gps_latency_sum += latency;
+
+    return true;
+}
+
+void get_gps_latency(struct gps_latency *l)
+{
+    *l = gps_latency;
+    if (l->count == 0)
+        l->min = 0;
+    else
+        l->mean = gps_latency_sum / l->count;
+}
 
-    if (timing_mode == MODE_PULSECOUNTER && record_trigger)
+void set_time(struct epoch_time *t, const struct uptime *received)
+{
+    bool pulse = gps_last_data == GPS_PULSE;
+
+    // Don't label the pulse with a time that was sent too late
+    // check_serial_timeout labels it from the local clock instead
+    if (pulse && !check_serial_latency(received))
+    {
+        gps_last_data = GPS_SERIAL;
+        return;
+    }
+
+    if (pulse)
     {
-        record_trigger = false;
-        if (--trigger_countdown == 0)
+        // Compare against the label of the most recent pulse, including any that were missed
+        int32_t difference;
+        ATOMIC_BLOCK(ATOMIC_FORCEON)
+        {
+            difference = t->seconds - (current_time.seconds + millisecond_count / 1000);
+            serial_pending = false;
+        }
+
+        bool step = !clock_valid;
+        if (clock_valid && difference != 0)
         {
-            download_timestamp = current_timestamp;
-            trigger_countdown = trigger_stride;
-            message_flags |= FLAG_SEND_TRIGGER;
+            counters.gps_time_mismatches++;
+            usb_send_message_fmt_P(fmt_time_mismatch, difference);
+            step = ++time_mismatches >= CLOCK_RESYNC_MISMATCHES;
         }
+        else
+            time_mismatches = 0;
+
+        ATOMIC_BLOCK(ATOMIC_FORCEON)
+        {
+            if (step)
+                current_time.seconds += difference;
+            current_time.flags = t->flags;
+            current_time.utc_offset = t->utc_offset;
+        }
+
+        if (step)
+            time_mismatches = 0;
     }
     else
     {
-        // Reset rollover count
+        // Without a time pulse the serial time is all that advances the clock
         ATOMIC_BLOCK(ATOMIC_FORCEON)
         {
-            while (millisecond_count > 1000)
+            current_time = *t;
+            while (millisecond_count >= 1000)
                 millisecond_count -= 1000;
         }
     }
 
+    clock_valid = true;
+    message_flags |= FLAG_SEND_TIMESTAMP;
+
+    if (gps_status != GPS_ACTIVE)
+        set_gps_status(GPS_ACTIVE);
+
+    label_recorded_trigger(true);
+
     // Send a warning about the missing pulse
     if (gps_last_data == GPS_SERIAL)
+    {
         message_flags |= FLAG_MISSING_PULSE;
+        counters.missing_pulses++;
+    }
     gps_last_data = GPS_SERIAL;
 }
@@ -23,6 +23,7 @@ enum timing_mode
 {
     MODE_PULSECOUNTER = 0,
     MODE_HIGHRES = 1,
+    MODE_FREQUENCY = 2,
 };
 
 extern uint8_t timing_mode;
@@ -43,12 +44,19 @@ extern uint8_t timing_mode;
 #define RELAY_DISABLED 0xFF
 #define RELAY_ENABLED 0x42
 
+// Persistent settings EEPROM parameters - one dword per setting
+#define SETTINGS_EEPROM_OFFSET (uint32_t *)(0x10)
+
+// Reported to the acquisition PC - major version in the high byte
+#define FIRMWARE_VERSION 0x0200
+
 extern uint16_t exposure_total;
 extern volatile uint16_t exposure_countdown;
 extern uint8_t trigger_stride;
 extern volatile uint8_t trigger_countdown;
 extern uint8_t align_boundary;
 extern volatile uint16_t millisecond_count;
+extern volatile uint32_t millisecond_uptime;
 
 enum message_flags
 {
@@ -59,14 +67,38 @@ enum message_flags
     FLAG_TIME_DRIFT        = _BV(4),
     FLAG_DUPLICATE_PULSE   = _BV(5),
     FLAG_MISSING_PULSE     = _BV(6),
+    FLAG_CAMERA_OVERRUN    = _BV(7),
 };
 
 extern volatile enum message_flags message_flags;
 
+struct counters
+{
+    uint32_t camera_triggers;
+    uint32_t trigger_reports;
+    uint16_t duplicate_pulses;
+    uint16_t missing_pulses;
+    uint16_t time_drifts;
+    uint16_t usb_checksum_errors;
+    uint16_t usb_packet_errors;
+    uint16_t camera_overruns;
+    uint16_t event_overflows;
+    uint16_t gps_pairing_rejects;
+    uint16_t gps_time_mismatches;
+};
+
+extern volatile struct counters counters;
+
 enum timestamp_flags
 {
     TIMESTAMP_LOCKED = _BV(0),
-    TIMESTAMP_IS_GPS = _BV(1)
+    TIMESTAMP_IS_GPS = _BV(1),
+
+    // Trigger time predicted at the GPS pulse, before the serial time has arrived
+    TIMESTAMP_PREDICTED = _BV(2),
+
+    // Receiver reports alarms or status that make the time unreliable
+    TIMESTAMP_DEGRADED = _BV(3)
 };
 
 struct timestamp
@@ -83,8 +115,61 @@ struct timestamp
     uint16_t exposure_progress;
 };
 
-extern volatile struct timestamp download_timestamp;
-extern struct timestamp current_timestamp;
+// GPS-disciplined time held as seconds since 1970-01-01, so that it can be
+// advanced and compared without calendar arithmetic.  It is converted to a
+// struct timestamp (see calendar.h) only when displayed or sent over USB
+struct epoch_time
+{
+    uint32_t seconds;
+    enum timestamp_flags flags;
+    int16_t utc_offset;
+};
+
+extern volatile struct epoch_time download_time;
+extern volatile uint16_t download_milliseconds;
+extern volatile uint32_t download_frame;
+extern volatile uint32_t download_ticks;
+extern volatile uint16_t download_microseconds;
+extern volatile int32_t download_pulse_error;
+extern struct epoch_time current_time;
+
+// Snapshot of the GPS-disciplined device clock
+// milliseconds follows the millisecond_count convention
+struct device_time
+{
+    struct epoch_time time;
+    uint16_t milliseconds;
+
+    // Sub-millisecond timer count (0.1us at 10MHz)
+    uint16_t ticks;
+};
+
+void get_device_time(struct device_time *t);
+
+// Free-running uptime captured in interrupt context
+struct uptime
+{
+    uint32_t milliseconds;
+
+    // Sub-millisecond timer count (0.1us at 10MHz)
+    uint16_t ticks;
+};
+
+void read_uptime(struct uptime *t);
+
+// Delay between the GPS pulse and the arrival of the serial time, in microseconds
+struct gps_latency
+{
+    uint32_t count;
+    uint32_t last;
+    uint32_t min;
+    uint32_t mean;
+    uint32_t max;
+};
+
+void get_gps_latency(struct gps_latency *l);
+void deferred_trigger_sent();
+void set_exposure_period(uint16_t exposure, uint8_t stride);
 
 enum timer_status
 {
@@ -93,7 +178,8 @@ enum timer_status
     TIMER_ALIGN,
     TIMER_EXPOSING,
     TIMER_READOUT,
-    TIMER_RELAY
+    TIMER_RELAY,
+    TIMER_COUNTING
 };
 
 extern volatile enum timer_status timer_status;
@@ -109,6 +195,7 @@ enum gps_status
 extern volatile enum gps_status gps_status;
 void set_gps_status(enum gps_status status);
 
-void set_time(struct timestamp *t);
+// received is the arrival time of the first byte of the serial packet
+void set_time(struct epoch_time *t, const struct uptime *received);
 
 #endif
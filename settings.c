@@ -0,0 +1,113 @@
+//***************************************************************************
+//
+//  File        : settings.c
+//  Copyright   : 2013 Paul Chote
+//  Description : Persistent configuration stored in EEPROM
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+
+#include "main.h"
+#include "camera.h"
+#include "event.h"
+#include "gps.h"
+#include "usb.h"
+#include "settings.h"
+
+struct setting_info
+{
+    uint32_t default_value;
+    uint32_t min;
+    uint32_t max;
+};
+
+static const struct setting_info setting_info[SETTING_COUNT] PROGMEM = {
+    // SETTING_GPS_TIMEOUT: seconds without serial data before the GPS is marked unavailable
+    {3, 1, 60},
+
+    // SETTING_OVERRUN_POLICY: action taken when the camera is triggered during readout
+    {OVERRUN_REPORT, OVERRUN_REPORT, OVERRUN_ABORT},
+
+    // SETTING_PHASE_OFFSET: delay in microseconds between the time pulse and high-resolution triggers
+    {0, 0, 999999},
+
+    // SETTING_EVENT_EDGES: edges of the event input that are timestamped
+    {EVENT_DISABLED, EVENT_DISABLED, EVENT_BOTH},
+
+    // SETTING_GPS_BAUD: fixed GPS serial rate, or automatic protocol and rate detection
+    // Takes effect after a reset
+    {GPS_BAUD_AUTO, GPS_BAUD_AUTO, GPS_BAUD_115200},
+
+    // SETTING_GPS_MAX_BAUD: highest rate that a detected receiver is switched to
+    {GPS_BAUD_115200, GPS_BAUD_9600, GPS_BAUD_115200},
+
+    // SETTING_GPS_ROLLOVER_PIVOT: earliest valid GPS date, in days since 1970-01-01 (default 2020-01-01)
+    // Earlier dates are advanced by multiples of 1024 weeks to correct for the GPS week rollover
+    {18262, 3657, UINT16_MAX},
+
+    // SETTING_GPS_PAIRING_WINDOW: milliseconds after the time pulse that the serial time must arrive within
+    {950, 10, 999},
+
+    // SETTING_USB_BAUD: serial rate of the link to the acquisition PC
+    // Takes effect after a reset.  The bootloader always uses 9600 baud
+    {USB_BAUD_9600, USB_BAUD_9600, USB_BAUD_115200},
+};
+
+// Settings are cached in RAM so they can be read cheaply from interrupt context
+static uint32_t settings[SETTING_COUNT];
+
+static bool setting_valid(enum setting_id id, uint32_t value)
+{
+    return value >= pgm_read_dword(&setting_info[id].min) &&
+           value <= pgm_read_dword(&setting_info[id].max);
+}
+
+/*
+ * Load settings from EEPROM, falling back to the defaults
+ * for erased or out-of-range values
+ */
+void settings_initialize()
+{
+    for (uint8_t i = 0; i < SETTING_COUNT; i++)
+    {
+        uint32_t value = eeprom_read_dword(SETTINGS_EEPROM_OFFSET + i);
+        if (!setting_valid(i, value))
+            value = pgm_read_dword(&setting_info[i].default_value);
+        settings[i] = value;
+    }
+}
+
+uint32_t settings_get(enum setting_id id)
+{
+    uint32_t value;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        value = settings[id];
+    }
+    return value;
+}
+
+/*
+ * Update a setting and save it to EEPROM
+ * Returns false if the id or value is invalid
+ */
+bool settings_set(enum setting_id id, uint32_t value)
+{
+    if (id >= SETTING_COUNT || !setting_valid(id, value))
+        return false;
+
+    ATOMIC_BLOCK(ATOMIC_FORCEON)
+    {
+        settings[id] = value;
+    }
+
+    eeprom_update_dword(SETTINGS_EEPROM_OFFSET + id, value);
+    return true;
+}
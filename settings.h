@@ -0,0 +1,38 @@
+//***************************************************************************
+//
+//  File        : settings.h
+//  Copyright   : 2013 Paul Chote
+//  Description : Persistent configuration stored in EEPROM
+//
+//  This file is part of Karaka, which is free software. It is made available
+//  to you under the terms of version 3 of the GNU General Public License, as
+//  published by the Free Software Foundation. For more information, see LICENSE.
+//
+//***************************************************************************
+
+#ifndef KARAKA_SETTINGS_H
+#define KARAKA_SETTINGS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Values are part of the USB protocol - append new settings only
+enum setting_id
+{
+    SETTING_GPS_TIMEOUT = 0,
+    SETTING_OVERRUN_POLICY = 1,
+    SETTING_PHASE_OFFSET = 2,
+    SETTING_EVENT_EDGES = 3,
+    SETTING_GPS_BAUD = 4,
+    SETTING_GPS_MAX_BAUD = 5,
+    SETTING_GPS_ROLLOVER_PIVOT = 6,
+    SETTING_GPS_PAIRING_WINDOW = 7,
+    SETTING_USB_BAUD = 8,
+    SETTING_COUNT
+};
+
+void settings_initialize();
+uint32_t settings_get(enum setting_id id);
+bool settings_set(enum setting_id id, uint32_t value);
+
+#endif
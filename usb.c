@@ -11,21 +11,41 @@
 //***************************************************************************
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <avr/eeprom.h>
 #include <avr/pgmspace.h>
 #include <util/atomic.h>
+#include <util/crc16.h>
 
 #include "display.h"
 #include "gps.h"
 #include "main.h"
 #include "camera.h"
+#include "settings.h"
+#include "event.h"
+#include "frequency.h"
+#include "calendar.h"
 #include "usb.h"
 
 #define MAX_DATA_LENGTH 200
-enum packet_state {HEADERA = 0, HEADERB, TYPE, LENGTH, DATA, CHECKSUM, FOOTERA, FOOTERB};
+
+// Header, length, sequence, checksum and footer bytes of a CRC16 frame
+#define MAX_FRAME_OVERHEAD 9
+
+// Must be a power of two so that the journal index
+// stays continuous when the sequence number wraps
+#define TRIGGER_JOURNAL_LENGTH 256
+
+// Includes the entry size so that a journal recovered from
+// a different firmware layout is discarded
+#define TRIGGER_JOURNAL_MAGIC (0x4A524E00UL | sizeof(struct packet_trigger))
+
+#define ACK_QUEUE_LENGTH 8
+
+enum packet_state {HEADERA = 0, HEADERB, TYPE, LENGTH, SEQUENCE, DATA, CHECKSUM, CHECKSUMB, FOOTERA, FOOTERB};
 enum packet_type
 {
     TIMESTAMP = 'A',
@@ -34,8 +54,171 @@ enum packet_type
     MESSAGE_RAW = 'D',
     START_EXPOSURE = 'E',
     STOP_EXPOSURE = 'F',
+    FRAMING = 'G',
     STATUS = 'H',
+    RESEND_TRIGGER = 'I',
+    ACK = 'K',
+    PING = 'P',
+    QUERY = 'Q',
     ENABLE_RELAY = 'R',
+    GPS_TUNNEL = 'T',
+    GPS_TUNNEL_ENABLE = 'U',
+    OVERRUN = 'O',
+    SET_PERIOD = 'M',
+    EVENT = 'V',
+    FREQUENCY = 'N',
+    GPS_HEALTH = 'L',
+};
+
+// Packet framing used in both directions
+//    FRAMING_LEGACY: $$ type length data xor-checksum \r\n
+//    FRAMING_CRC16:  $$ type length sequence data crc-lo crc-hi \r\n
+//       The CRC-16/CCITT (0x8408 reflected, init 0xFFFF) covers type,
+//       length, sequence and data. Each side increments its own 8-bit
+//       sequence number per packet so the receiver can detect losses.
+//
+// The device always boots using legacy framing, which is what the
+// FT232R DTR reset gives us at connect time. The host then requests
+// a version with a FRAMING packet and must wait for the reply (sent
+// using the old framing) before switching.
+enum framing_version
+{
+    FRAMING_LEGACY = 1,
+    FRAMING_CRC16 = 2
+};
+
+enum frame_result
+{
+    FRAME_INCOMPLETE,
+    FRAME_COMPLETE,
+    FRAME_TOO_LONG,
+    FRAME_BAD_CHECKSUM,
+    FRAME_BAD_FOOTERA,
+    FRAME_BAD_FOOTERB
+};
+
+// Advertised in response to QUERY_VERSION
+enum capability_flags
+{
+    CAPABILITY_CRC16_FRAMING     = _BV(0),
+    CAPABILITY_QUERY             = _BV(1),
+    CAPABILITY_FAST_COMMANDS     = _BV(2),
+    CAPABILITY_PING              = _BV(3),
+    CAPABILITY_COMMAND_ACK       = _BV(4),
+    CAPABILITY_GPS_TUNNEL        = _BV(5),
+    CAPABILITY_TRIGGER_JOURNAL   = _BV(6),
+    CAPABILITY_PREDICTED_TRIGGER = _BV(7),
+    CAPABILITY_OVERRUN           = _BV(8),
+    CAPABILITY_READOUT_STATS     = _BV(9),
+    CAPABILITY_SET_PERIOD        = _BV(10),
+    CAPABILITY_PHASE_OFFSET      = _BV(11),
+    CAPABILITY_EVENTS            = _BV(12),
+    CAPABILITY_FREQUENCY         = _BV(13),
+    CAPABILITY_PULSE_ERROR       = _BV(14),
+
+    // _BV() is a 16-bit int, so higher bits must be unsigned long
+    CAPABILITY_GPS_HEALTH        = 1UL << 15,
+    CAPABILITY_GPS_LATENCY       = 1UL << 16,
+    CAPABILITY_GPS_STATS         = 1UL << 17,
+    CAPABILITY_USB_BAUD          = 1UL << 18,
+};
+
+#define CAPABILITIES (CAPABILITY_CRC16_FRAMING | CAPABILITY_QUERY | CAPABILITY_FAST_COMMANDS | \
+                      CAPABILITY_PING | CAPABILITY_COMMAND_ACK | \
+                      CAPABILITY_GPS_TUNNEL | CAPABILITY_TRIGGER_JOURNAL | \
+                      CAPABILITY_PREDICTED_TRIGGER | CAPABILITY_OVERRUN | \
+                      CAPABILITY_READOUT_STATS | CAPABILITY_SET_PERIOD | \
+                      CAPABILITY_PHASE_OFFSET | CAPABILITY_EVENTS | \
+                      CAPABILITY_FREQUENCY | CAPABILITY_PULSE_ERROR | \
+                      CAPABILITY_GPS_HEALTH | CAPABILITY_GPS_LATENCY | \
+                      CAPABILITY_GPS_STATS | CAPABILITY_USB_BAUD)
+
+// QUERY packets are answered with a QUERY packet that echoes the
+// query type and the sequence number of the request frame (zero when
+// using legacy framing) so the host can match up the response
+enum query_type
+{
+    QUERY_VERSION = 0,
+    QUERY_EXPOSURE = 1,
+    QUERY_COUNTERS = 2,
+    QUERY_GET_SETTING = 3,
+    QUERY_SET_SETTING = 4,
+    QUERY_JOURNAL = 5,
+    QUERY_READOUT = 6,
+    QUERY_GPS_HEALTH = 7,
+    QUERY_GPS_LATENCY = 8,
+    QUERY_GPS_STATS = 9,
+
+    // Returns the statistics before they were cleared
+    QUERY_RESET_GPS_STATS = 10,
+};
+
+enum query_result
+{
+    QUERY_OK = 0,
+    QUERY_UNKNOWN = 1,
+    QUERY_INVALID = 2,
+};
+
+struct packet_query
+{
+    uint8_t query;
+    uint8_t setting;
+    uint32_t value;
+};
+
+struct query_version
+{
+    uint16_t firmware;
+    uint8_t framing;
+    uint32_t capabilities;
+};
+
+struct query_exposure
+{
+    enum timing_mode mode;
+    uint8_t use_monitor;
+    uint16_t exposure;
+    uint8_t stride;
+    uint8_t align_boundary;
+    uint16_t exposure_progress;
+    enum timer_status timer;
+    enum gps_status gps;
+    uint16_t trigger_sequence;
+};
+
+struct query_setting
+{
+    uint8_t setting;
+    uint32_t value;
+};
+
+// Range of trigger sequence numbers that can be requested with RESEND_TRIGGER
+// recovered is set if the journal survived a reset of the timer
+struct query_journal
+{
+    uint16_t first;
+    uint16_t next;
+    uint8_t recovered;
+};
+
+struct packet_query_response
+{
+    uint8_t tag;
+    uint8_t query;
+    uint8_t result;
+    union
+    {
+        struct query_version version;
+        struct query_exposure exposure;
+        struct counters counters;
+        struct query_setting setting;
+        struct query_journal journal;
+        struct readout_stats readout;
+        struct gps_health health;
+        struct gps_latency latency;
+        struct gps_stats gps_stats;
+    } data;
 };
 
 struct packet_startexposure
@@ -53,6 +236,109 @@ struct packet_status
     enum gps_status gps;
 };
 
+// Device times are sent in calendar form
+struct packet_device_time
+{
+    struct timestamp time;
+
+    // Sub-millisecond timer count (0.1us at 10MHz)
+    uint16_t ticks;
+};
+
+// frame is the index of the camera trigger within the exposure sequence
+// ticks is the number of milliseconds between the start of the sequence and the trigger
+// microseconds is added to time.milliseconds when a phase offset is applied
+// pulse_error is the receiver's quantization error (ps) for the time pulse that the
+// trigger timing is referenced to, or zero if the receiver doesn't report it
+struct packet_trigger
+{
+    struct timestamp time;
+    uint16_t sequence;
+    uint32_t frame;
+    uint32_t ticks;
+    uint16_t microseconds;
+    int32_t pulse_error;
+};
+
+// Exposure is in the units of the running sequence (seconds or milliseconds)
+struct packet_setperiod
+{
+    uint16_t exposure;
+    uint8_t stride;
+};
+
+// A two byte RESEND_TRIGGER packet contains only first and requests a single trigger
+struct packet_resend
+{
+    uint16_t first;
+    uint16_t count;
+};
+
+enum ack_result
+{
+    ACK_OK = 0,
+    ACK_UNKNOWN_COMMAND = 1,
+    ACK_INVALID = 2,
+    ACK_UNAVAILABLE = 3,
+};
+
+// Sent in reply to each command packet once it has been applied (or rejected)
+// tag echoes the sequence number of the command frame (zero when using legacy framing)
+// time is the device clock when the command was applied
+struct packet_ack
+{
+    enum packet_type type;
+    enum ack_result result;
+    uint8_t tag;
+    struct packet_device_time time;
+};
+
+// Acknowledgement waiting to be sent, with the time in internal form
+struct pending_ack
+{
+    enum packet_type type;
+    enum ack_result result;
+    uint8_t tag;
+    struct device_time time;
+};
+
+// Clock offset / latency probe, answered NTP-style:
+// the host-supplied origin data is echoed back along with the device
+// time when the request was received and when the reply was queued
+struct packet_ping
+{
+    uint8_t tag;
+    uint8_t origin[8];
+    struct packet_device_time received;
+    struct packet_device_time transmitted;
+};
+
+// See struct event
+struct packet_event
+{
+    uint16_t sequence;
+    uint8_t level;
+    struct packet_device_time time;
+};
+
+// See struct camera_overrun
+struct packet_overrun
+{
+    uint32_t frame;
+    enum overrun_policy policy;
+    struct packet_device_time detected;
+    struct packet_device_time triggered;
+};
+
+// See struct frequency_reading
+struct packet_frequency
+{
+    struct packet_device_time time;
+    uint32_t cycles;
+    uint32_t ticks;
+    uint32_t frequency;
+};
+
 struct packet_message
 {
     uint8_t length;
@@ -64,22 +350,28 @@ struct timer_packet
     enum packet_state state;
     enum packet_type type;
     uint8_t length;
+    uint8_t sequence;
     uint8_t progress;
-    uint8_t checksum;
+    uint16_t checksum;
+    uint16_t received_checksum;
 
     union
     {
         // Extra byte allows us to always null-terminate strings for display
         uint8_t bytes[MAX_DATA_LENGTH+1];
         struct packet_startexposure startexp;
+        uint8_t framing;
+        struct packet_resend resend;
+        struct packet_setperiod setperiod;
+        struct packet_query query;
     } data;
 };
 
 const char unknown_packet_fmt[]  PROGMEM = "Unknown packet type '%c' - ignoring";
 const char long_packet_fmt[]     PROGMEM = "Ignoring long packet: %c (length %u)";
-const char checksum_failed_fmt[] PROGMEM = "Packet checksum failed. Got 0x%02x, expected 0x%02x";
+const char checksum_failed_fmt[] PROGMEM = "Packet checksum failed. Got 0x%04x, expected 0x%04x";
 const char invalid_packet_fmt[]  PROGMEM = "Invalid packet end byte. Got 0x%02x, expected 0x%02x";
-const char got_packet_fmt[]      PROGMEM = "Got packet type '%c'";
+const char overrun_fmt[]         PROGMEM = "WARNING: Camera overrun at frame %lu";
 
 static uint8_t input_buffer[256];
 static uint8_t input_read = 0;
@@ -89,6 +381,49 @@ static uint8_t output_buffer[256];
 static volatile uint8_t output_read = 0;
 static volatile uint8_t output_write = 0;
 
+static enum framing_version framing = FRAMING_LEGACY;
+static uint8_t output_sequence = 0;
+
+// Recently sent triggers, kept for retransmission if the host
+// detects a gap in the trigger sequence numbers or loses its connection.
+// The journal lives in .noinit so that it survives the reset caused
+// by the FT232R DTR line when the host reopens the serial port
+struct trigger_journal
+{
+    uint32_t magic;
+    uint16_t sequence;
+    struct packet_trigger entries[TRIGGER_JOURNAL_LENGTH];
+};
+
+static struct trigger_journal journal __attribute__ ((section (".noinit")));
+static bool journal_recovered;
+
+// Trigger that was reported at the GPS pulse and is waiting for the serial time
+static bool prediction_pending = false;
+static uint16_t prediction_sequence;
+static uint32_t prediction_frame;
+
+// Journal entries waiting to be resent
+static uint16_t replay_next;
+static uint16_t replay_remaining = 0;
+
+// Commands applied from the receive interrupt, waiting to be acknowledged
+static struct pending_ack ack_queue[ACK_QUEUE_LENGTH];
+static uint8_t ack_read = 0;
+static volatile uint8_t ack_write = 0;
+
+// Ping request received by the receive interrupt, waiting for a reply
+static struct packet_ping ping;
+static struct device_time ping_received;
+static volatile bool ping_pending = false;
+
+// Convert a device time to the calendar form sent to the acquisition PC
+static void pack_device_time(struct packet_device_time *p, const struct device_time *t)
+{
+    calendar_timestamp(&p->time, &t->time, t->milliseconds);
+    p->ticks = t->ticks;
+}
+
 // Add a byte to the send buffer.
 // Will block if the buffer is full
 static void queue_byte(uint8_t b)
@@ -111,21 +446,56 @@ static void queue_data(uint8_t type, const void *data, uint8_t length)
     queue_byte(type);
     queue_byte(length);
 
-    // Data
-    uint8_t checksum = 0;
-    for (uint8_t i = 0; i < length; i++)
+    if (framing == FRAMING_CRC16)
+    {
+        uint16_t crc = 0xFFFF;
+        crc = _crc_ccitt_update(crc, type);
+        crc = _crc_ccitt_update(crc, length);
+        crc = _crc_ccitt_update(crc, output_sequence);
+        queue_byte(output_sequence++);
+
+        for (uint8_t i = 0; i < length; i++)
+        {
+            uint8_t b = ((uint8_t *)data)[i];
+            queue_byte(b);
+            crc = _crc_ccitt_update(crc, b);
+        }
+
+        queue_byte(crc & 0xFF);
+        queue_byte(crc >> 8);
+    }
+    else
     {
-        uint8_t b = ((uint8_t *)data)[i];
-        queue_byte(b);
-        checksum ^= b;
+        uint8_t checksum = 0;
+        for (uint8_t i = 0; i < length; i++)
+        {
+            uint8_t b = ((uint8_t *)data)[i];
+            queue_byte(b);
+            checksum ^= b;
+        }
+
+        queue_byte(checksum);
     }
 
     // Footer
-    queue_byte(checksum);
     queue_byte('\r');
     queue_byte('\n');
 }
 
+static void queue_trigger(struct packet_trigger *trigger)
+{
+    // Legacy framing keeps the original packet layout
+    if (framing == FRAMING_CRC16)
+        queue_data(TRIGGER, trigger, sizeof(struct packet_trigger));
+    else
+        queue_data(TRIGGER, &trigger->time, sizeof(struct timestamp));
+}
+
+static uint8_t output_free()
+{
+    return (uint8_t)(output_read - output_write - 1);
+}
+
 static bool byte_available()
 {
     return input_write != input_read;
@@ -148,84 +518,486 @@ ISR(USART0_UDRE_vect)
         UCSR0B &= ~_BV(UDRIE0);
 }
 
-ISR(USART0_RX_vect)
-{
-    input_buffer[(uint8_t)(input_write++)] = UDR0;
-}
+// Baud rate register values assume double speed mode
+#define UBRR_2X(baud) ((F_CPU + 4UL * (baud)) / (8UL * (baud)) - 1)
+
+// Indexed by enum usb_baud
+static const uint16_t baud_ubrr[] PROGMEM = {
+    UBRR_2X(9600),
+    UBRR_2X(19200),
+    UBRR_2X(38400),
+    UBRR_2X(57600),
+    UBRR_2X(115200),
+};
 
 void usb_initialize()
 {
-#define BAUD 9600
-#include <util/setbaud.h>
-    UBRR0H = UBRRH_VALUE;
-    UBRR0L = UBRRL_VALUE;
-#if USE_2X
+    // The link defaults to 9600 baud, which limits the rate of the
+    // trigger, health, and replay traffic.  Faster rates are opt-in
+    // so that existing acquisition software keeps working
+    uint16_t ubrr = pgm_read_word(&baud_ubrr[settings_get(SETTING_USB_BAUD)]);
+    UBRR0H = ubrr >> 8;
+    UBRR0L = ubrr & 0xFF;
     UCSR0A = _BV(U2X0);
-#endif
 
     // Enable receive, transmit, data received interrupt
     UCSR0B = _BV(RXEN0) | _BV(TXEN0) | _BV(RXCIE0);
 
     input_read = input_write = 0;
     output_read = output_write = 0;
+
+    // Keep the journal from before a reset, unless the RAM contents are garbage
+    journal_recovered = journal.magic == TRIGGER_JOURNAL_MAGIC;
+    if (!journal_recovered)
+    {
+        journal.magic = TRIGGER_JOURNAL_MAGIC;
+        journal.sequence = 0;
+    }
 }
 
-static void parse_packet(struct timer_packet *p)
+static bool journal_contains(uint16_t sequence)
 {
-    usb_send_message_fmt_P(got_packet_fmt, p->type);
-    switch (p->type)
+    return (uint16_t)(journal.sequence - sequence - 1) < TRIGGER_JOURNAL_LENGTH;
+}
+
+static void parse_query(struct timer_packet *p)
+{
+    struct packet_query *query = &p->data.query;
+    struct packet_query_response r = {
+        .tag = p->sequence,
+        .query = query->query,
+        .result = QUERY_OK
+    };
+    uint8_t length = 0;
+
+    if (p->length < 1)
     {
-        case START_EXPOSURE:
-        {
-            struct packet_startexposure *data = &p->data.startexp;
+        r.result = QUERY_INVALID;
+        queue_data(QUERY, &r, offsetof(struct packet_query_response, data));
+        return;
+    }
 
-            timing_mode = data->mode;
+    switch (query->query)
+    {
+        case QUERY_VERSION:
+            r.data.version = (struct query_version) {
+                .firmware = FIRMWARE_VERSION,
+                .framing = FRAMING_CRC16,
+                .capabilities = CAPABILITIES
+            };
+            length = sizeof(struct query_version);
+            break;
+        case QUERY_EXPOSURE:
+            ATOMIC_BLOCK(ATOMIC_FORCEON)
+            {
+                r.data.exposure = (struct query_exposure) {
+                    .mode = timing_mode,
+                    .use_monitor = camera_monitor_enabled(),
+                    .exposure = exposure_total,
+                    .stride = trigger_stride,
+                    .align_boundary = align_boundary,
+                    .exposure_progress = exposure_total - exposure_countdown,
+                    .timer = timer_status,
+                    .gps = gps_status,
+                    .trigger_sequence = journal.sequence
+                };
+            }
+            length = sizeof(struct query_exposure);
+            break;
+        case QUERY_COUNTERS:
+            ATOMIC_BLOCK(ATOMIC_FORCEON)
+            {
+                r.data.counters = counters;
+            }
+            length = sizeof(struct counters);
+            break;
+        case QUERY_JOURNAL:
+            ATOMIC_BLOCK(ATOMIC_FORCEON)
+            {
+                uint16_t stored = journal.sequence;
+                if (stored > TRIGGER_JOURNAL_LENGTH)
+                    stored = TRIGGER_JOURNAL_LENGTH;
 
-            // These are only accessed from interrupt context
-            // when timer_status == ALIGN,EXPOSING,READOUT so
-            // these is safe to modify with interrupts enabled
-            exposure_countdown = exposure_total = data->exposure;
-            trigger_countdown = trigger_stride = data->stride;
+                r.data.journal = (struct query_journal) {
+                    .first = journal.sequence - stored,
+                    .next = journal.sequence,
+                    .recovered = journal_recovered
+                };
+            }
+            length = sizeof(struct query_journal);
+            break;
+        case QUERY_READOUT:
+            camera_get_readout_stats(&r.data.readout);
+            length = sizeof(struct readout_stats);
+            break;
+        case QUERY_GPS_HEALTH:
+            gps_get_health(&r.data.health);
+            length = sizeof(struct gps_health);
+            break;
+        case QUERY_GPS_LATENCY:
+            get_gps_latency(&r.data.latency);
+            length = sizeof(struct gps_latency);
+            break;
+        case QUERY_GPS_STATS:
+        case QUERY_RESET_GPS_STATS:
+            gps_get_stats(&r.data.gps_stats, query->query == QUERY_RESET_GPS_STATS);
+            length = sizeof(struct gps_stats);
+            break;
+        case QUERY_SET_SETTING:
+            if (p->length < 6 || !settings_set(query->setting, query->value))
+            {
+                r.result = QUERY_INVALID;
+                break;
+            }
 
-            // align_boundary is 8-bit, so use a temporary variable
-            uint16_t temp_boundary = exposure_total;
-            if (timing_mode == MODE_HIGHRES)
-                temp_boundary /= 1000;
+            // Report the new value
+            /* fall through */
+        case QUERY_GET_SETTING:
+            if (p->length < 2 || query->setting >= SETTING_COUNT)
+            {
+                r.result = QUERY_INVALID;
+                break;
+            }
 
-            if (temp_boundary < 1 || data->align_first == 0)
-                temp_boundary = 1;
-            else if (temp_boundary > 60)
-                temp_boundary = 60;
+            r.data.setting.setting = query->setting;
+            r.data.setting.value = settings_get(query->setting);
+            length = sizeof(struct query_setting);
+            break;
+        default:
+            r.result = QUERY_UNKNOWN;
+            break;
+    }
 
-            align_boundary = temp_boundary;
+    queue_data(QUERY, &r, offsetof(struct packet_query_response, data) + length);
+}
 
-            camera_start_exposing(data->use_monitor);
+static void start_exposure(struct packet_startexposure *data)
+{
+    // Reclaim the trigger timer from the frequency counter
+    if (timer_status == TIMER_COUNTING)
+        frequency_stop();
 
-            // Update display configuration for new sequence
-            display_update_config();
-            break;
-        }
-        case STOP_EXPOSURE:
-            // Disable the exposure countdown immediately
-            STOP_MILLISECOND_TIMER;
-            millisecond_count = 0;
+    timing_mode = data->mode;
 
-            // These are only accessed from interrupt context
-            // when timer_status == ALIGN,EXPOSING,READOUT so
-            // these is safe to modify with interrupts enabled
-            exposure_total = 0;
-            exposure_countdown = 0;
+    // The frequency counter runs independently of the camera
+    // The remaining fields are ignored
+    if (timing_mode == MODE_FREQUENCY)
+    {
+        exposure_total = exposure_countdown = 0;
+        frequency_start();
+        set_timer_status(TIMER_COUNTING);
+        display_update_config();
+        return;
+    }
 
-            camera_stop_exposing();
-            break;
+    // These are only accessed from interrupt context
+    // when timer_status == ALIGN,EXPOSING,READOUT so
+    // these is safe to modify with interrupts enabled
+    exposure_countdown = exposure_total = data->exposure;
+    trigger_countdown = trigger_stride = data->stride;
+
+    // Trigger sequence numbers count from the start of each sequence
+    // This discards the journal from the previous sequence
+    journal.sequence = 0;
+    journal_recovered = false;
+    replay_remaining = 0;
+    prediction_pending = false;
+
+    // align_boundary is 8-bit, so use a temporary variable
+    uint16_t temp_boundary = exposure_total;
+    if (timing_mode == MODE_HIGHRES)
+        temp_boundary /= 1000;
+
+    if (temp_boundary < 1 || data->align_first == 0)
+        temp_boundary = 1;
+    else if (temp_boundary > 60)
+        temp_boundary = 60;
+
+    align_boundary = temp_boundary;
+
+    camera_start_exposing(data->use_monitor);
+
+    // Update display configuration for new sequence
+    display_update_config();
+}
+
+static void stop_exposure()
+{
+    if (timer_status == TIMER_COUNTING)
+    {
+        frequency_stop();
+        message_flags |= FLAG_STOP_EXPOSURE;
+        set_timer_status(TIMER_IDLE);
+        return;
+    }
+
+    // Disable the exposure countdown immediately
+    // The millisecond timer keeps running as the device clock
+    exposure_total = 0;
+    exposure_countdown = 0;
+
+    camera_stop_exposing();
+}
+
+static void send_ack(const struct pending_ack *pending)
+{
+    struct packet_ack ack = {
+        .type = pending->type,
+        .result = pending->result,
+        .tag = pending->tag
+    };
+
+    pack_device_time(&ack.time, &pending->time);
+    queue_data(ACK, &ack, sizeof(struct packet_ack));
+}
+
+static void queue_ack(enum packet_type type, enum ack_result result, uint8_t tag)
+{
+    struct pending_ack ack = {
+        .type = type,
+        .result = result,
+        .tag = tag
+    };
+
+    get_device_time(&ack.time);
+    send_ack(&ack);
+}
+
+static void parse_packet(struct timer_packet *p)
+{
+    enum ack_result result = ACK_OK;
+    switch (p->type)
+    {
+        case START_EXPOSURE:
+        case STOP_EXPOSURE:
+        case PING:
+            // Already handled by the receive interrupt
+            return;
+        case FRAMING:
+        {
+            // Reply using the current framing, then switch
+            uint8_t version = p->data.framing;
+            if (version < FRAMING_LEGACY)
+                version = FRAMING_LEGACY;
+            else if (version > FRAMING_CRC16)
+                version = FRAMING_CRC16;
+
+            queue_data(FRAMING, &version, sizeof(uint8_t));
+            framing = version;
+            output_sequence = 0;
+            return;
+        }
+        case QUERY:
+            parse_query(p);
+            return;
         case ENABLE_RELAY:
             eeprom_update_byte(RELAY_EEPROM_OFFSET, RELAY_ENABLED);
             eeprom_update_byte(BOOTLOADER_EEPROM_OFFSET, BYPASS_ENABLED);
             break;
+        case GPS_TUNNEL_ENABLE:
+            // Unlike ENABLE_RELAY, the tunnel doesn't require a reboot
+            // and the GPS timing continues to be parsed while it is open
+            if (p->length != sizeof(uint8_t))
+                result = ACK_INVALID;
+            else
+                gps_enable_tunnel(p->data.bytes[0]);
+            break;
+        case GPS_TUNNEL:
+            // Tunneled data is not acknowledged to keep the stream lightweight
+            for (uint8_t i = 0; i < p->length; i++)
+                gps_send_byte(p->data.bytes[i]);
+            return;
+        case SET_PERIOD:
+        {
+            // Applied at the next trigger so the sequence stays aligned with the time pulse
+            struct packet_setperiod *period = &p->data.setperiod;
+            if (p->length != sizeof(struct packet_setperiod) || period->exposure == 0 || period->stride == 0)
+                result = ACK_INVALID;
+            else if (timer_status != TIMER_EXPOSING && timer_status != TIMER_READOUT)
+                result = ACK_UNAVAILABLE;
+            else
+                set_exposure_period(period->exposure, period->stride);
+            break;
+        }
+        case RESEND_TRIGGER:
+        {
+            struct packet_resend *resend = &p->data.resend;
+            if (p->length == sizeof(uint16_t))
+                resend->count = 1;
+            else if (p->length != sizeof(struct packet_resend))
+            {
+                result = ACK_INVALID;
+                break;
+            }
+
+            // Triggers are streamed from usb_tick as space becomes
+            // available in the output buffer.  The request is truncated
+            // to the triggers that have been recorded so far
+            ATOMIC_BLOCK(ATOMIC_FORCEON)
+            {
+                if (resend->count == 0 || !journal_contains(resend->first))
+                    result = ACK_UNAVAILABLE;
+                else
+                {
+                    uint16_t available = journal.sequence - resend->first;
+                    replay_next = resend->first;
+                    replay_remaining = resend->count < available ? resend->count : available;
+                }
+            }
+            break;
+        }
         default:
             usb_send_message_fmt_P(unknown_packet_fmt, p->type);
+            result = ACK_UNKNOWN_COMMAND;
+            break;
+    }
+
+    queue_ack(p->type, result, p->sequence);
+}
+
+// Process a single received byte
+// Safe to call from interrupt context: errors are reported to the caller
+static enum frame_result parse_byte(struct timer_packet *p, uint8_t b)
+{
+    switch (p->state)
+    {
+        case HEADERA:
+        case HEADERB:
+            if (b == '$')
+                p->state++;
+            else
+                p->state = HEADERA;
+            break;
+        case TYPE:
+            p->type = b;
+            p->checksum = _crc_ccitt_update(0xFFFF, b);
+            p->state++;
+            break;
+        case LENGTH:
+            p->length = b;
+            p->progress = 0;
+            p->sequence = 0;
+            if (framing == FRAMING_CRC16)
+                p->checksum = _crc_ccitt_update(p->checksum, b);
+            else
+                p->checksum = 0;
+
+            if (p->length > sizeof(p->data))
+            {
+                p->state = HEADERA;
+                return FRAME_TOO_LONG;
+            }
+            else if (framing == FRAMING_CRC16)
+                p->state = SEQUENCE;
+            else
+                p->state = p->length == 0 ? CHECKSUM : DATA;
+            break;
+        case SEQUENCE:
+            p->sequence = b;
+            p->checksum = _crc_ccitt_update(p->checksum, b);
+            p->state = p->length == 0 ? CHECKSUM : DATA;
+            break;
+        case DATA:
+            if (framing == FRAMING_CRC16)
+                p->checksum = _crc_ccitt_update(p->checksum, b);
+            else
+                p->checksum ^= b;
+
+            p->data.bytes[p->progress++] = b;
+            if (p->progress == p->length)
+                p->state = CHECKSUM;
+            break;
+        case CHECKSUM:
+            p->received_checksum = b;
+            if (framing == FRAMING_CRC16)
+                p->state = CHECKSUMB;
+            else if (p->checksum == b)
+                p->state = FOOTERA;
+            else
+            {
+                p->state = HEADERA;
+                return FRAME_BAD_CHECKSUM;
+            }
+            break;
+        case CHECKSUMB:
+            p->received_checksum |= b << 8;
+            if (p->checksum == p->received_checksum)
+                p->state = FOOTERA;
+            else
+            {
+                p->state = HEADERA;
+                return FRAME_BAD_CHECKSUM;
+            }
+            break;
+        case FOOTERA:
+            if (b == '\r')
+                p->state++;
+            else
+            {
+                p->state = HEADERA;
+                return FRAME_BAD_FOOTERA;
+            }
+            break;
+        case FOOTERB:
+            p->state = HEADERA;
+            return b == '\n' ? FRAME_COMPLETE : FRAME_BAD_FOOTERB;
+    }
+
+    return FRAME_INCOMPLETE;
+}
+
+/*
+ * Latency-critical commands are parsed and applied as each byte arrives
+ * so that their timing doesn't depend on the main loop. The main loop
+ * parser sees the same bytes and ignores these packet types.
+ */
+ISR(USART0_RX_vect)
+{
+    static struct timer_packet p = {.state = HEADERA};
+
+    uint8_t b = UDR0;
+    input_buffer[(uint8_t)(input_write++)] = b;
+
+    if (parse_byte(&p, b) != FRAME_COMPLETE)
+        return;
+
+    enum ack_result result = ACK_OK;
+    switch (p.type)
+    {
+        case START_EXPOSURE:
+            if (p.length != sizeof(struct packet_startexposure) || p.data.startexp.mode > MODE_FREQUENCY)
+                result = ACK_INVALID;
+            else
+                start_exposure(&p.data.startexp);
             break;
+        case STOP_EXPOSURE:
+            stop_exposure();
+            break;
+        case PING:
+            // Only one request can be outstanding
+            if (ping_pending)
+                return;
+
+            get_device_time(&ping_received);
+            ping.tag = p.sequence;
+            memset(ping.origin, 0, sizeof(ping.origin));
+            memcpy(ping.origin, p.data.bytes, p.length < sizeof(ping.origin) ? p.length : sizeof(ping.origin));
+            ping_pending = true;
+            return;
+        default:
+            return;
     }
+
+    // Drop the acknowledgement if the main loop has fallen behind
+    if ((uint8_t)(ack_write - ack_read) == ACK_QUEUE_LENGTH)
+        return;
+
+    struct pending_ack *ack = &ack_queue[ack_write % ACK_QUEUE_LENGTH];
+    ack->type = p.type;
+    ack->result = result;
+    ack->tag = p.sequence;
+    get_device_time(&ack->time);
+    ack_write++;
 }
 
 void usb_tick()
@@ -237,67 +1009,108 @@ void usb_tick()
         if (timer_status == TIMER_RELAY)
             gps_send_byte(b);
 
-        switch (p.state)
+        switch (parse_byte(&p, b))
         {
-            case HEADERA:
-            case HEADERB:
-                if (b == '$')
-                    p.state++;
-                else
-                    p.state = HEADERA;
+            case FRAME_INCOMPLETE:
                 break;
-            case TYPE:
-                p.type = b;
-                p.state++;
+            case FRAME_COMPLETE:
+                parse_packet(&p);
                 break;
-            case LENGTH:
-                p.length = b;
-                p.progress = 0;
-                p.checksum = 0;
-                if (p.length == 0)
-                    p.state = CHECKSUM;
-                else if (p.length <= sizeof(p.data))
-                    p.state++;
-                else
-                {
-                    usb_send_message_fmt_P(long_packet_fmt, p.type, p.length);
-                    p.state = HEADERA;
-                }
+            case FRAME_TOO_LONG:
+                usb_send_message_fmt_P(long_packet_fmt, p.type, p.length);
+                counters.usb_packet_errors++;
                 break;
-            case DATA:
-                p.checksum ^= b;
-                p.data.bytes[p.progress++] = b;
-                if (p.progress == p.length)
-                    p.state++;
+            case FRAME_BAD_CHECKSUM:
+                usb_send_message_fmt_P(checksum_failed_fmt, p.received_checksum, p.checksum);
+                counters.usb_checksum_errors++;
                 break;
-            case CHECKSUM:
-                if (p.checksum == b)
-                    p.state++;
-                else
-                {
-                    usb_send_message_fmt_P(checksum_failed_fmt, b, p.checksum);
-                    p.state = HEADERA;
-                }
+            case FRAME_BAD_FOOTERA:
+                usb_send_message_fmt_P(invalid_packet_fmt, b, '\r');
+                counters.usb_packet_errors++;
                 break;
-            case FOOTERA:
-                if (b == '\r')
-                    p.state++;
-                else
-                {
-                    usb_send_message_fmt_P(invalid_packet_fmt, b, '\r');
-                    p.state = HEADERA;
-                }
-                break;
-            case FOOTERB:
-                if (b == '\n')
-                    parse_packet(&p);
-                else
-                    usb_send_message_fmt_P(invalid_packet_fmt, b, '\n');
-    
-                p.state = HEADERA;
+            case FRAME_BAD_FOOTERB:
+                usb_send_message_fmt_P(invalid_packet_fmt, b, '\n');
+                counters.usb_packet_errors++;
                 break;
         }
     }
+
+    if (ping_pending)
+    {
+        struct device_time transmitted;
+        get_device_time(&transmitted);
+        pack_device_time(&ping.received, &ping_received);
+        pack_device_time(&ping.transmitted, &transmitted);
+        queue_data(PING, &ping, sizeof(struct packet_ping));
+        ping_pending = false;
+    }
+
+    // Acknowledge commands that were applied by the receive interrupt
+    while (ack_read != ack_write)
+    {
+        send_ack(&ack_queue[ack_read % ACK_QUEUE_LENGTH]);
+        ack_read++;
+    }
+
+    // Stream buffered external events without blocking on the output buffer
+    // Legacy hosts don't understand the EVENT packet, so the buffer is discarded
+    struct event e;
+    while (output_free() >= MAX_FRAME_OVERHEAD + sizeof(struct packet_event) && event_read(&e))
+    {
+        if (framing != FRAMING_CRC16)
+            continue;
+
+        struct packet_event event = {
+            .sequence = e.sequence,
+            .level = e.level
+        };
+        pack_device_time(&event.time, &e.time);
+        queue_data(EVENT, &event, sizeof(struct packet_event));
+    }
+
+    // Frequency counter measurements are sent once per second
+    struct frequency_reading reading;
+    if (frequency_read(&reading) && framing == FRAMING_CRC16)
+    {
+        struct packet_frequency frequency = {
+            .cycles = reading.cycles,
+            .ticks = reading.ticks,
+            .frequency = reading.frequency
+        };
+        pack_device_time(&frequency.time, &reading.time);
+        queue_data(FREQUENCY, &frequency, sizeof(struct packet_frequency));
+    }
+
+    // Receiver health is sent when the alarms or status change
+    if (gps_health_changed() && framing == FRAMING_CRC16)
+    {
+        struct gps_health health;
+        gps_get_health(&health);
+        queue_data(GPS_HEALTH, &health, sizeof(struct gps_health));
+    }
+
+    // Resend journal entries without blocking on the output buffer
+    while (replay_remaining > 0 && output_free() >= MAX_FRAME_OVERHEAD + sizeof(struct packet_trigger))
+    {
+        struct packet_trigger trigger;
+        bool valid = false;
+        ATOMIC_BLOCK(ATOMIC_FORCEON)
+        {
+            // Entries may have been overwritten by new triggers during the replay
+            if (replay_remaining > 0 && journal_contains(replay_next))
+            {
+                trigger = journal.entries[replay_next % TRIGGER_JOURNAL_LENGTH];
+                valid = true;
+                replay_next++;
+                replay_remaining--;
+            }
+            else
+                replay_remaining = 0;
+        }
+
+        if (valid)
+            queue_trigger(&trigger);
+    }
 }
 
 void usb_send_message_P(const char *string)
@@ -335,16 +1148,51 @@ void usb_send_timestamp()
     {
         count = exposure_countdown;
     }
-    current_timestamp.exposure_progress = exposure_total - count;
+    struct timestamp t;
+    calendar_timestamp(&t, &current_time, 0);
+    t.exposure_progress = exposure_total - count;
 
-    queue_data(TIMESTAMP, &current_timestamp, sizeof(struct timestamp));
+    queue_data(TIMESTAMP, &t, sizeof(struct timestamp));
 }
 
 void usb_send_trigger()
 {
-    // This is non-atomic, but something is very wrong if this
-    // doesn't get sent before the next exposure is triggered
-    queue_data(TRIGGER, (void *)&download_timestamp, sizeof(struct timestamp));
+    struct packet_trigger trigger;
+    struct epoch_time time;
+    uint16_t milliseconds;
+    ATOMIC_BLOCK(ATOMIC_FORCEON)
+    {
+        time = download_time;
+        milliseconds = download_milliseconds;
+        trigger.frame = download_frame;
+        trigger.ticks = download_ticks;
+        trigger.microseconds = download_microseconds;
+        trigger.pulse_error = download_pulse_error;
+    }
+
+    calendar_timestamp(&trigger.time, &time, milliseconds);
+
+    // Legacy hosts expect a single report per trigger, so only send the confirmed time
+    bool predicted = trigger.time.flags & TIMESTAMP_PREDICTED;
+    if (predicted && framing != FRAMING_CRC16)
+        return;
+
+    // The confirmed time reuses the sequence number of the prediction,
+    // and replaces it in the journal
+    if (!predicted && prediction_pending && prediction_frame == trigger.frame)
+        trigger.sequence = prediction_sequence;
+    else
+    {
+        trigger.sequence = journal.sequence++;
+        counters.trigger_reports++;
+    }
+
+    prediction_pending = predicted;
+    prediction_sequence = trigger.sequence;
+    prediction_frame = trigger.frame;
+
+    journal.entries[trigger.sequence % TRIGGER_JOURNAL_LENGTH] = trigger;
+    queue_trigger(&trigger);
 }
 
 void usb_stop_exposure()
@@ -352,6 +1200,30 @@ void usb_stop_exposure()
     queue_data(STOP_EXPOSURE, NULL, 0);
 }
 
+void usb_send_overrun()
+{
+    struct camera_overrun overrun;
+    ATOMIC_BLOCK(ATOMIC_FORCEON)
+    {
+        overrun = camera_overrun;
+    }
+
+    // Legacy hosts don't understand the OVERRUN packet
+    if (framing != FRAMING_CRC16)
+    {
+        usb_send_message_fmt_P(overrun_fmt, overrun.frame);
+        return;
+    }
+
+    struct packet_overrun packet = {
+        .frame = overrun.frame,
+        .policy = overrun.policy
+    };
+    pack_device_time(&packet.detected, &overrun.detected);
+    pack_device_time(&packet.triggered, &overrun.triggered);
+    queue_data(OVERRUN, &packet, sizeof(struct packet_overrun));
+}
+
 void usb_send_status(enum timer_status timer, enum gps_status gps)
 {
     struct packet_status data = {
@@ -372,6 +1244,12 @@ void usb_send_raw(uint8_t *data, uint8_t length)
     queue_data(MESSAGE_RAW, &msg, msg.length + 1);
 }
 
+// Send bytes received from the GPS while the tunnel is enabled
+void usb_send_gps_tunnel(const uint8_t *data, uint8_t length)
+{
+    queue_data(GPS_TUNNEL, data, length);
+}
+
 // Send a raw byte without wrapping in a packet
 // Used for relay mode
 void usb_send_byte(uint8_t b)
@@ -16,16 +16,29 @@
 #ifndef KARAKA_USB_H
 #define KARAKA_USB_H
 
+// Serial rates for the link to the acquisition PC
+// Values are part of the USB protocol (SETTING_USB_BAUD)
+enum usb_baud
+{
+    USB_BAUD_9600 = 0,
+    USB_BAUD_19200 = 1,
+    USB_BAUD_38400 = 2,
+    USB_BAUD_57600 = 3,
+    USB_BAUD_115200 = 4,
+};
+
 void usb_initialize();
 void usb_tick();
 
 void usb_send_message_P(const char *string);
 void usb_send_message_fmt_P(const char *fmt, ...);
 void usb_send_raw(uint8_t *data, uint8_t length);
+void usb_send_gps_tunnel(const uint8_t *data, uint8_t length);
 void usb_send_timestamp();
 void usb_send_trigger();
 void usb_send_status(enum timer_status timer, enum gps_status gps);
 void usb_stop_exposure();
+void usb_send_overrun();
 
 void usb_send_byte(uint8_t b);
 